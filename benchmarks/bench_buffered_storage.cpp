@@ -0,0 +1,255 @@
+#include "bench_types.hpp"
+#include "cache_storage.hpp"
+
+#include <algorithm>
+#include <array>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using storage_t = trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                                bench_type_identifier_t>;
+
+const auto unused_filepath = trace_cache::tmp_directory + "caching_lib_bench_unused.bin";
+
+// Store benchmarks measure the producer side, flushed data is discarded.
+const auto discard_filepath = std::string{ "/dev/null" };
+
+enum class sample_mix_t
+{
+    fixed,   // bench_fixed_sample only
+    string,  // bench_string_sample with a payload of range(0) bytes
+    mixed    // three fixed samples for every string sample
+};
+
+// Shared by all threads of a running store benchmark, owned by thread 0.
+std::unique_ptr<silence_cout_t> g_silence;
+std::unique_ptr<storage_t>      g_storage;
+
+void
+start_shared_storage(const benchmark::State& state)
+{
+    if(state.thread_index() == 0)
+    {
+        g_silence = std::make_unique<silence_cout_t>();
+        g_storage = std::make_unique<storage_t>(discard_filepath);
+        g_storage->start();
+    }
+}
+
+void
+stop_shared_storage(const benchmark::State& state)
+{
+    if(state.thread_index() == 0)
+    {
+        g_storage->shutdown();
+        g_storage.reset();
+        g_silence.reset();
+    }
+}
+
+// Stores one sample and returns the number of bytes it takes in the buffer.
+__attribute__((always_inline)) inline size_t
+store_sample(storage_t& storage, sample_mix_t mix, std::string_view payload,
+             uint64_t index)
+{
+    const bool store_string = mix == sample_mix_t::string ||
+                              (mix == sample_mix_t::mixed && index % 4 == 0);
+    if(store_string)
+    {
+        const bench_string_sample sample{ index, payload };
+        storage.store(sample);
+        return trace_cache::header_size<bench_type_identifier_t> +
+               trace_cache::get_size(sample);
+    }
+
+    const bench_fixed_sample sample{ index, static_cast<uint32_t>(index), 1.0 };
+    storage.store(sample);
+    return trace_cache::header_size<bench_type_identifier_t> +
+           trace_cache::get_size(sample);
+}
+
+// Previous behaviour, a value initialized std::array zero-fills every page.
+void
+construct_zero_filled_array(benchmark::State& state)
+{
+    for(auto _ : state)
+    {
+        auto buffer = std::make_unique<std::array<uint8_t, trace_cache::buffer_size>>();
+        benchmark::DoNotOptimize(buffer->data());
+    }
+}
+
+void
+construct_storage(benchmark::State& state, trace_cache::buffer_allocation_t allocation)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.allocation = allocation;
+
+    for(auto _ : state)
+    {
+        storage_t storage{ unused_filepath, config };
+        benchmark::DoNotOptimize(&storage);
+    }
+}
+
+void
+store_throughput(benchmark::State& state, sample_mix_t mix)
+{
+    const std::string payload(state.range(0), 'x');
+    size_t            bytes = 0;
+    uint64_t          index = 0;
+
+    start_shared_storage(state);
+    for(auto _ : state)
+    {
+        bytes += store_sample(*g_storage, mix, payload, index++);
+    }
+    stop_shared_storage(state);
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(bytes);
+}
+
+// Times every store separately and reports latency percentiles in nanoseconds.
+// Percentiles are computed per thread and averaged over threads. The clock reads
+// add a constant overhead of a few tens of nanoseconds to every sample.
+void
+store_latency(benchmark::State& state, sample_mix_t mix)
+{
+    using clock_t = std::chrono::steady_clock;
+
+    const std::string   payload(state.range(0), 'x');
+    std::vector<double> latencies;
+    latencies.reserve(state.max_iterations);
+    size_t   bytes = 0;
+    uint64_t index = 0;
+
+    start_shared_storage(state);
+    for(auto _ : state)
+    {
+        const auto _begin = clock_t::now();
+        bytes += store_sample(*g_storage, mix, payload, index++);
+        const auto _end = clock_t::now();
+        latencies.push_back(
+            std::chrono::duration<double, std::nano>(_end - _begin).count());
+    }
+    stop_shared_storage(state);
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(bytes);
+
+    if(latencies.empty())
+    {
+        return;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&](double fraction) {
+        const auto _index = static_cast<size_t>(fraction * latencies.size());
+        return latencies[std::min(_index, latencies.size() - 1)];
+    };
+
+    state.counters["p50_ns"] =
+        benchmark::Counter(percentile(0.50), benchmark::Counter::kAvgThreads);
+    state.counters["p99_ns"] =
+        benchmark::Counter(percentile(0.99), benchmark::Counter::kAvgThreads);
+    state.counters["p999_ns"] =
+        benchmark::Counter(percentile(0.999), benchmark::Counter::kAvgThreads);
+}
+
+// Stores string samples of range(0) bytes into a real file, so the cost of
+// getting the data into the file is included.
+void
+store_to_file(benchmark::State& state, trace_cache::buffer_allocation_t allocation)
+{
+    silence_cout_t _silence;
+
+    const auto filepath = trace_cache::tmp_directory + "caching_lib_bench_file.bin";
+    const std::string payload(state.range(0), 'x');
+    size_t            bytes = 0;
+    uint64_t          index = 0;
+
+    trace_cache::buffered_storage_config_t config;
+    config.allocation = allocation;
+    {
+        storage_t storage{ filepath, config };
+        storage.start();
+        for(auto _ : state)
+        {
+            bytes += store_sample(storage, sample_mix_t::string, payload, index++);
+        }
+        storage.shutdown();
+    }
+    std::remove(filepath.c_str());
+
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(bytes);
+}
+
+}  // namespace
+
+BENCHMARK(construct_zero_filled_array)->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(construct_storage, heap, trace_cache::buffer_allocation_t::heap)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(construct_storage, mmap, trace_cache::buffer_allocation_t::mmap)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(construct_storage, mmap_populate,
+                  trace_cache::buffer_allocation_t::mmap_populate)
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_CAPTURE(construct_storage, mmap_huge_pages,
+                  trace_cache::buffer_allocation_t::mmap_huge_pages)
+    ->Unit(benchmark::kMicrosecond);
+
+// range(0) is the string payload size, unused by the fixed sample mix.
+BENCHMARK_CAPTURE(store_throughput, fixed, sample_mix_t::fixed)
+    ->ArgName("payload")
+    ->Arg(0)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(store_throughput, string, sample_mix_t::string)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(store_throughput, mixed, sample_mix_t::mixed)
+    ->ArgName("payload")
+    ->Arg(256)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+BENCHMARK_CAPTURE(store_latency, fixed, sample_mix_t::fixed)
+    ->ArgName("payload")
+    ->Arg(0)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(store_latency, string, sample_mix_t::string)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(store_latency, mixed, sample_mix_t::mixed)
+    ->ArgName("payload")
+    ->Arg(256)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+BENCHMARK_CAPTURE(store_to_file, write, trace_cache::buffer_allocation_t::mmap)
+    ->ArgName("payload")
+    ->Arg(256)
+    ->Arg(4096)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(store_to_file, mapped_file,
+                  trace_cache::buffer_allocation_t::mapped_file)
+    ->ArgName("payload")
+    ->Arg(256)
+    ->Arg(4096)
+    ->UseRealTime();
@@ -0,0 +1,135 @@
+#include "bench_types.hpp"
+#include "cache_storage.hpp"
+#include "storage_parser.hpp"
+
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace
+{
+
+using storage_t = trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                                bench_type_identifier_t>;
+
+// Size of the generated file parsed on every iteration.
+constexpr size_t parsed_file_size = 64 * trace_cache::MByte;
+
+struct counting_processor_t
+{
+    void execute_sample_processing(bench_type_identifier_t          type_identifier,
+                                   const trace_cache::cacheable_t& value)
+    {
+        benchmark::DoNotOptimize(type_identifier);
+        benchmark::DoNotOptimize(&value);
+        samples++;
+    }
+
+    size_t samples{ 0 };
+};
+
+using parser_t =
+    trace_cache::storage_parser<bench_type_identifier_t, counting_processor_t,
+                                bench_fixed_sample, bench_string_sample>;
+
+// Writes a file of string samples with the given payload size, every fourth
+// sample is a fixed one. Returns the size of the file.
+size_t
+generate_file(const std::string& filepath, size_t payload_size)
+{
+    const std::string payload(payload_size, 'x');
+    {
+        storage_t storage{ filepath };
+        storage.start();
+
+        size_t   written = 0;
+        uint64_t index   = 0;
+        while(written < parsed_file_size)
+        {
+            if(index % 4 == 0)
+            {
+                const bench_fixed_sample sample{ index, static_cast<uint32_t>(index),
+                                                 1.0 };
+                storage.store(sample);
+                written += trace_cache::get_size(sample);
+            }
+            else
+            {
+                const bench_string_sample sample{ index, payload };
+                storage.store(sample);
+                written += trace_cache::get_size(sample);
+            }
+            written += trace_cache::header_size<bench_type_identifier_t>;
+            index++;
+        }
+        storage.shutdown();
+    }
+    return std::filesystem::file_size(filepath);
+}
+
+// range(0) is the payload size of the string samples. The parser removes the
+// file it consumed, so every iteration parses a fresh copy of the generated one.
+void
+parse_file(benchmark::State& state, trace_cache::parser_read_mode_t read_mode)
+{
+    silence_cout_t _silence;
+
+    const auto source_filepath =
+        trace_cache::tmp_directory + "caching_lib_bench_parser_source.bin";
+    const auto parsed_filepath =
+        trace_cache::tmp_directory + "caching_lib_bench_parser.bin";
+
+    const auto file_size = generate_file(source_filepath, state.range(0));
+    size_t     samples   = 0;
+
+    trace_cache::storage_parser_config_t config;
+    config.read_mode = read_mode;
+
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        std::filesystem::copy_file(source_filepath, parsed_filepath,
+                                   std::filesystem::copy_options::overwrite_existing);
+        auto  processor     = std::make_unique<counting_processor_t>();
+        auto* processor_ptr = processor.get();
+        state.ResumeTiming();
+
+        parser_t parser{ parsed_filepath, std::move(processor), config };
+        parser.load();
+        samples += processor_ptr->samples;
+    }
+
+    std::filesystem::remove(source_filepath);
+
+    state.SetItemsProcessed(samples);
+    state.SetBytesProcessed(state.iterations() * file_size);
+}
+
+}  // namespace
+
+BENCHMARK_CAPTURE(parse_file, stream, trace_cache::parser_read_mode_t::stream)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(parse_file, mmap, trace_cache::parser_read_mode_t::mmap)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(parse_file, mmap_populate,
+                  trace_cache::parser_read_mode_t::mmap_populate)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(parse_file, read_ahead, trace_cache::parser_read_mode_t::read_ahead)
+    ->ArgName("payload")
+    ->RangeMultiplier(8)
+    ->Range(16, 4096)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "cacheable.hpp"
+#include <cstddef>
+#include <iostream>
+#include <streambuf>
+#include <string_view>
+
+enum class bench_type_identifier_t : uint32_t
+{
+    fixed_sample     = 1,
+    string_sample    = 2,
+    fragmented_space = 0xFFFF
+};
+
+// Small fixed size sample, similar to a counter or timestamp record.
+struct bench_fixed_sample : public trace_cache::cacheable_t
+{
+    static constexpr bench_type_identifier_t type_identifier =
+        bench_type_identifier_t::fixed_sample;
+
+    bench_fixed_sample() = default;
+    bench_fixed_sample(uint64_t ts, uint32_t id, double v)
+    : timestamp(ts)
+    , sample_id(id)
+    , value(v)
+    {}
+
+    uint64_t timestamp = 0;
+    uint32_t sample_id = 0;
+    double   value     = 0.0;
+};
+
+// Variable size sample carrying a string payload.
+struct bench_string_sample : public trace_cache::cacheable_t
+{
+    static constexpr bench_type_identifier_t type_identifier =
+        bench_type_identifier_t::string_sample;
+
+    bench_string_sample() = default;
+    bench_string_sample(uint64_t ts, std::string_view s)
+    : timestamp(ts)
+    , text(s)
+    {}
+
+    uint64_t         timestamp = 0;
+    std::string_view text;
+};
+
+template <>
+inline void
+trace_cache::serialize(uint8_t* buffer, const bench_fixed_sample& item)
+{
+    trace_cache::utility::store_value(buffer, item.timestamp, item.sample_id, item.value);
+}
+
+template <>
+inline bench_fixed_sample
+trace_cache::deserialize(uint8_t*& buffer)
+{
+    bench_fixed_sample result;
+    trace_cache::utility::parse_value(buffer, result.timestamp, result.sample_id,
+                                      result.value);
+    return result;
+}
+
+template <>
+inline size_t
+trace_cache::get_size(const bench_fixed_sample& item)
+{
+    return trace_cache::utility::get_size(item.timestamp, item.sample_id, item.value);
+}
+
+template <>
+inline void
+trace_cache::serialize(uint8_t* buffer, const bench_string_sample& item)
+{
+    trace_cache::utility::store_value(buffer, item.timestamp, item.text);
+}
+
+template <>
+inline bench_string_sample
+trace_cache::deserialize(uint8_t*& buffer)
+{
+    bench_string_sample result;
+    trace_cache::utility::parse_value(buffer, result.timestamp, result.text);
+    return result;
+}
+
+template <>
+inline size_t
+trace_cache::get_size(const bench_string_sample& item)
+{
+    return trace_cache::utility::get_size(item.timestamp, item.text);
+}
+
+// Discards std::cout output while alive, so status messages of the library do not
+// end up in the benchmark report (e.g. with --benchmark_format=json).
+class silence_cout_t
+{
+public:
+    silence_cout_t()
+    : m_previous(std::cout.rdbuf(&m_null_buffer))
+    {}
+
+    ~silence_cout_t() { std::cout.rdbuf(m_previous); }
+
+    silence_cout_t(const silence_cout_t&)            = delete;
+    silence_cout_t& operator=(const silence_cout_t&) = delete;
+
+private:
+    struct null_buffer_t : public std::streambuf
+    {
+        int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+    };
+
+    null_buffer_t   m_null_buffer;
+    std::streambuf* m_previous;
+};
@@ -218,25 +218,19 @@ struct type_processing_t
         m_enabled_formats.emplace_back(format);
     }
 
-    void execute_sample_processing(type_identifier_t               type_identifier,
-                                    const trace_cache::cacheable_t& value)
+    void process(const track_sample& track)
     {
         for(const auto& handler : m_enabled_formats)
         {
-            switch(type_identifier)
-            {
-                case type_identifier_t::track_sample:
-                {
-                    handler.handle_track(static_cast<const track_sample&>(value));
-                    break;
-                }
-                case type_identifier_t::process_sample:
-                {
-                    handler.handle_process(static_cast<const process_sample&>(value));
-                    break;
-                }
-                default: break;
-            }
+            handler.handle_track(track);
+        }
+    }
+
+    void process(const process_sample& process)
+    {
+        for(const auto& handler : m_enabled_formats)
+        {
+            handler.handle_process(process);
         }
     }
 
@@ -0,0 +1,101 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+namespace trace_cache
+{
+
+enum class file_format_t
+{
+    raw,    // records only, exactly as they were stored
+    framed  // records grouped into blocks, one per flush, behind a block_header_t
+};
+
+constexpr uint64_t block_magic = 0x314b434f4c424354;  // "TCBLOCK1"
+constexpr uint64_t index_magic = 0x315845444e494354;  // "TCINDEX1"
+
+// Bits of block_header_t::flags.
+constexpr uint32_t block_flag_checksum = 1 << 0;
+constexpr uint32_t block_flag_index    = 1 << 1;  // holds the type index, not records
+
+// Precedes the records of every block of a framed file. Samples are numbered in
+// file order starting from 0, fragmented space records are not counted. A block
+// without samples has last_sequence equal to first_sequence.
+struct __attribute__((packed)) block_header_t
+{
+    uint64_t magic{ block_magic };
+    uint32_t flags{ 0 };
+    uint32_t checksum{ 0 };  // CRC-32C of the records, with block_flag_checksum
+    uint64_t length{ 0 };    // bytes of records following the header
+    uint64_t record_count{ 0 };
+    uint64_t first_sequence{ 0 };
+    uint64_t last_sequence{ 0 };
+};
+
+// The index block holds one entry per stored type, each followed by block_count
+// file offsets of the headers of the blocks holding samples of that type, in
+// file order. An index_trailer_t closes the block and the file.
+struct __attribute__((packed)) type_index_entry_t
+{
+    uint64_t type;  // underlying value of the type identifier
+    uint64_t sample_count;
+    uint64_t block_count;
+};
+
+struct __attribute__((packed)) index_trailer_t
+{
+    uint64_t index_offset{ 0 };  // of the index block header
+    uint64_t magic{ index_magic };
+};
+
+namespace utility
+{
+
+constexpr std::array<uint32_t, 256>
+make_crc32c_table()
+{
+    std::array<uint32_t, 256> _table{};
+    for(uint32_t i = 0; i < _table.size(); ++i)
+    {
+        uint32_t _crc = i;
+        for(int bit = 0; bit < 8; ++bit)
+        {
+            _crc = (_crc >> 1) ^ ((_crc & 1) != 0 ? 0x82f63b78 : 0);
+        }
+        _table[i] = _crc;
+    }
+    return _table;
+}
+
+inline constexpr auto crc32c_table = make_crc32c_table();
+
+// Data written in several parts is checksummed by passing the previous result.
+inline uint32_t
+crc32c(const uint8_t* data, const size_t& size, uint32_t crc = 0)
+{
+    crc = ~crc;
+    for(size_t i = 0; i < size; ++i)
+    {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Raw files start with a record header, whose type identifier and size do not
+// form the block magic in practice.
+inline bool
+is_framed(const uint8_t* data, const size_t& size)
+{
+    uint64_t _magic = 0;
+    if(size < sizeof(_magic))
+    {
+        return false;
+    }
+    std::memcpy(&_magic, data, sizeof(_magic));
+    return _magic == block_magic;
+}
+
+}  // namespace utility
+}  // namespace trace_cache
@@ -1,42 +1,74 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <bits/chrono.h>
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <ostream>
 #include <sstream>
+#include <sys/mman.h>
 #include <stdexcept>
 #include <stdint.h>
 #include <string.h>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
+#include "block_format.hpp"
 #include "cacheable.hpp"
+#include "sink.hpp"
 
 namespace trace_cache
 {
 
-using ofs_t             = std::basic_ostream<char>;
-using worker_function_t = std::function<void(ofs_t& ofs, bool force)>;
+using worker_function_t   = std::function<void(sink_t& sink, bool force)>;
+using consumer_function_t = std::function<void(uint8_t* data, size_t size)>;
+using sink_factory_t =
+    std::function<std::unique_ptr<sink_t>(const std::string& filepath)>;
 
 struct worker_synchronization_t
 {
+    // Wakes the flushing thread. Writers call this once when the buffer crosses
+    // the flush threshold, not on every store.
+    void request_flush()
+    {
+        {
+            std::lock_guard _lock{ mutex };
+            flush_requested = true;
+        }
+        is_running_condition.notify_one();
+    }
+
+    std::mutex mutex;
+
     std::condition_variable is_running_condition;
     bool                    is_running{ false };
+    bool                    flush_requested{ false };
 
     std::condition_variable exit_finished_condition;
     bool                    exit_finished{ false };
+    // Set by the flushing thread for its final flush, once its loop has exited.
+    // Forced flushes before that, e.g. on an elapsed interval, do not close.
+    bool                    closing{ false };
 
     pid_t origin_pid;
+    // Optional periodic wakeup, zero means the flusher only wakes up on request.
+    std::chrono::milliseconds flush_interval{ 0 };
 };
 using worker_synchronization_ptr_t = std::shared_ptr<worker_synchronization_t>;
 
@@ -44,42 +76,61 @@ struct flush_worker_t
 {
     explicit flush_worker_t(worker_function_t            worker_function,
                             worker_synchronization_ptr_t worker_synchronization_ptr,
-                            std::string                  filepath)
+                            std::string                  filepath,
+                            sink_factory_t               sink_factory = make_file_sink)
 
     : m_worker_function(worker_function)
     , m_worker_synchronization(std::move(worker_synchronization_ptr))
     , m_filepath(std::move(filepath))
+    , m_sink_factory(std::move(sink_factory))
     {}
 
-    void start(const pid_t& current_pid)
+    static std::unique_ptr<sink_t> make_file_sink(const std::string& filepath)
     {
-        m_ofs = std::ofstream{ m_filepath, std::ios::binary | std::ios::out };
+        return std::make_unique<file_sink_t>(filepath);
+    }
 
-        if(!m_ofs.good())
-        {
-            std::stringstream _ss;
-            _ss << "Error opening file for writing: " << m_filepath;
-            throw std::runtime_error(_ss.str());
-        }
+    void start(const pid_t& current_pid)
+    {
+        // Without a filepath the storage hands its data to a consumer instead.
+        m_sink = m_filepath.empty() ? std::make_unique<null_sink_t>()
+                                    : m_sink_factory(m_filepath);
 
         m_worker_synchronization->origin_pid = current_pid;
         m_worker_synchronization->is_running = true;
+        m_worker_synchronization->closing    = false;
 
         m_flushing_thread = std::make_unique<std::thread>([&]() {
-            std::mutex _shutdown_condition_mutex;
-            while(m_worker_synchronization->is_running)
+            auto& _sync   = *m_worker_synchronization;
+            auto  _wakeup = [&]() { return !_sync.is_running || _sync.flush_requested; };
+
+            // An elapsed flush interval writes out everything committed so far.
+            bool _interval_elapsed = false;
+            while(_sync.is_running)
             {
-                m_worker_function(m_ofs, false);
-                std::unique_lock _lock{ _shutdown_condition_mutex };
-                m_worker_synchronization->is_running_condition.wait_for(
-                    _lock, std::chrono::milliseconds(CACHE_FILE_FLUSH_TIMEOUT),
-                    [&]() { return !m_worker_synchronization->is_running; });
+                m_worker_function(*m_sink, _interval_elapsed);
+
+                std::unique_lock _lock{ _sync.mutex };
+                if(_sync.flush_interval.count() == 0)
+                {
+                    _sync.is_running_condition.wait(_lock, _wakeup);
+                }
+                else
+                {
+                    _interval_elapsed = !_sync.is_running_condition.wait_for(
+                        _lock, _sync.flush_interval, _wakeup);
+                }
+                _sync.flush_requested = false;
             }
 
-            m_worker_function(m_ofs, true);
-            m_ofs.close();
-            m_worker_synchronization->exit_finished = true;
-            m_worker_synchronization->exit_finished_condition.notify_one();
+            _sync.closing = true;
+            m_worker_function(*m_sink, true);
+            m_sink.reset();
+            {
+                std::lock_guard _lock{ _sync.mutex };
+                _sync.exit_finished = true;
+            }
+            _sync.exit_finished_condition.notify_one();
         });
     }
 
@@ -92,23 +143,25 @@ struct flush_worker_t
         if(flushing_thread_exist && worker_is_running)
         {
             std::cout << "Buffer storage shutting down.." << std::endl;
-            m_worker_synchronization->is_running = false;
-            m_worker_synchronization->is_running_condition.notify_all();
 
             const bool thread_is_created_in_this_process =
                 current_pid == m_worker_synchronization->origin_pid;
             if(!thread_is_created_in_this_process)
             {
+                // The flushing thread does not exist in a forked child and the
+                // mutex may have been copied in a locked state.
+                m_worker_synchronization->is_running = false;
                 std::cout
                     << "Buffer storage is not created in same process as shutting down.."
                     << std::endl;
                 return;
             }
 
-            std::mutex       _exit_mutex;
-            std::unique_lock _exit_lock{ _exit_mutex };
+            std::unique_lock _lock{ m_worker_synchronization->mutex };
+            m_worker_synchronization->is_running = false;
+            m_worker_synchronization->is_running_condition.notify_all();
             m_worker_synchronization->exit_finished_condition.wait(
-                _exit_lock, [&]() { return m_worker_synchronization->exit_finished; });
+                _lock, [&]() { return m_worker_synchronization->exit_finished; });
 
             if(m_flushing_thread->joinable())
             {
@@ -122,19 +175,22 @@ private:
     worker_function_t            m_worker_function;
     worker_synchronization_ptr_t m_worker_synchronization;
     std::string                  m_filepath;
-    std::ofstream                m_ofs;
+    sink_factory_t               m_sink_factory;
+    std::unique_ptr<sink_t>      m_sink;
     std::unique_ptr<std::thread> m_flushing_thread;
 };
 
-struct flush_worker_factory_t
+// Flush workers writing the file through Sink, constructed from the filepath.
+template <typename Sink>
+struct sink_flush_worker_factory_t
 {
     using worker_t = flush_worker_t;
 
-    flush_worker_factory_t()                                    = delete;
-    flush_worker_factory_t(flush_worker_factory_t&)             = delete;
-    flush_worker_factory_t& operator=(flush_worker_factory_t&)  = delete;
-    flush_worker_factory_t(flush_worker_factory_t&&)            = delete;
-    flush_worker_factory_t& operator=(flush_worker_factory_t&&) = delete;
+    sink_flush_worker_factory_t()                                         = delete;
+    sink_flush_worker_factory_t(sink_flush_worker_factory_t&)             = delete;
+    sink_flush_worker_factory_t& operator=(sink_flush_worker_factory_t&)  = delete;
+    sink_flush_worker_factory_t(sink_flush_worker_factory_t&&)            = delete;
+    sink_flush_worker_factory_t& operator=(sink_flush_worker_factory_t&&) = delete;
 
     static std::shared_ptr<worker_t> get_worker(
         worker_function_t                   worker_function,
@@ -142,8 +198,303 @@ struct flush_worker_factory_t
         std::string                         filepath)
     {
         return std::make_shared<worker_t>(worker_function, worker_synchronization_ptr,
-                                          std::move(filepath));
+                                          std::move(filepath),
+                                          [](const std::string& _filepath) {
+                                              return std::make_unique<Sink>(_filepath);
+                                          });
+    }
+};
+
+using flush_worker_factory_t          = sink_flush_worker_factory_t<file_sink_t>;
+using direct_flush_worker_factory_t   = sink_flush_worker_factory_t<direct_file_sink_t>;
+using ofstream_flush_worker_factory_t = sink_flush_worker_factory_t<ofstream_sink_t>;
+
+enum class buffer_allocation_t
+{
+    heap,            // plain allocation, for platforms without mmap
+    mmap,            // anonymous mapping, pages are faulted in as the ring advances
+    mmap_populate,   // anonymous mapping prefaulted at construction (MAP_POPULATE)
+    mmap_huge_pages,  // huge page backed mapping, falls back to transparent huge pages
+    mapped_file       // shared mapping of the output file, see mapped_file_buffer_t
+};
+
+class buffer_memory_t
+{
+public:
+    buffer_memory_t(size_t size, buffer_allocation_t allocation)
+    : m_size(size)
+    , m_mapped_size(size)
+    , m_allocation(allocation)
+    {
+        if(m_allocation == buffer_allocation_t::heap)
+        {
+            // Zeroed, skipped ranges of the buffer end up in the file as they are.
+            m_data = new uint8_t[m_size]();
+            return;
+        }
+
+        int   _flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void* _data  = MAP_FAILED;
+
+        if(m_allocation == buffer_allocation_t::mmap_populate)
+        {
+            _flags |= MAP_POPULATE;
+        }
+        else if(m_allocation == buffer_allocation_t::mmap_huge_pages)
+        {
+            m_mapped_size =
+                (m_size + huge_page_size - 1) / huge_page_size * huge_page_size;
+            _data = mmap(nullptr, m_mapped_size, PROT_READ | PROT_WRITE,
+                         _flags | MAP_HUGETLB, -1, 0);
+        }
+
+        if(_data == MAP_FAILED)
+        {
+            _data = mmap(nullptr, m_mapped_size, PROT_READ | PROT_WRITE, _flags, -1, 0);
+            if(_data != MAP_FAILED &&
+               m_allocation == buffer_allocation_t::mmap_huge_pages)
+            {
+                madvise(_data, m_mapped_size, MADV_HUGEPAGE);
+            }
+        }
+
+        if(_data == MAP_FAILED)
+        {
+            std::stringstream _ss;
+            _ss << "Unable to map " << m_size << " bytes for buffered storage.";
+            throw std::runtime_error(_ss.str());
+        }
+        m_data = static_cast<uint8_t*>(_data);
+    }
+
+    virtual ~buffer_memory_t()
+    {
+        if(m_allocation == buffer_allocation_t::heap)
+        {
+            delete[] m_data;
+        }
+        else
+        {
+            munmap(m_data, m_mapped_size);
+        }
+    }
+
+    buffer_memory_t(const buffer_memory_t&)            = delete;
+    buffer_memory_t& operator=(const buffer_memory_t&) = delete;
+
+    uint8_t* data() const { return m_data; }
+    size_t   size() const { return m_size; }
+
+protected:
+    // Takes over a mapping made by a derived class, unmapped on destruction.
+    buffer_memory_t(uint8_t* data, size_t size, buffer_allocation_t allocation)
+    : m_data(data)
+    , m_size(size)
+    , m_mapped_size(size)
+    , m_allocation(allocation)
+    {}
+
+private:
+    static constexpr size_t huge_page_size = 2 * MByte;
+
+    uint8_t*            m_data{ nullptr };
+    size_t              m_size;
+    size_t              m_mapped_size;
+    buffer_allocation_t m_allocation;
+};
+
+// The buffer is a shared mapping of the output file, so samples are serialized
+// straight into its page cache and never copied again by a write. Position p of
+// the ring in lap L is file offset L * size() + p: records wrap exactly as in
+// the ring and the file holds the same records a written one would. Pages are
+// remapped to the next lap once everything in them is flushed. The file is
+// extended a lap ahead and only gets its final size when closed, so it cannot
+// be followed while it is written. Errors while the kernel pages the file in,
+// e.g. ENOSPC, are raised as SIGBUS in the writing thread and not reported as
+// errors, so this mode needs enough free space for a lap of the ring.
+class mapped_file_buffer_t : public buffer_memory_t
+{
+public:
+    mapped_file_buffer_t(const std::string& filepath, size_t size)
+    : mapped_file_buffer_t(open_file(filepath), filepath, round_to_pages(size))
+    {}
+
+    ~mapped_file_buffer_t() override { close(m_fd); }
+
+    mapped_file_buffer_t(const mapped_file_buffer_t&)            = delete;
+    mapped_file_buffer_t& operator=(const mapped_file_buffer_t&) = delete;
+
+    static size_t page_size()
+    {
+        static const size_t _page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return _page_size;
+    }
+
+    // Everything before file offset end is complete. Starts writing it back and
+    // moves the pages entirely before end to the next lap. Returns false if the
+    // pages could not be moved, they must not be written again then.
+    bool flush(const size_t& end)
+    {
+        const size_t _page = page_size();
+        const size_t _done = end / _page * _page;
+
+        // Contiguous in the ring except at the wrap point.
+        while(m_remapped < _done)
+        {
+            const size_t _position = m_remapped % size();
+            const size_t _length   = std::min(_done - m_remapped, size() - _position);
+            msync(data() + _position, _length, MS_ASYNC);
+
+            const size_t _offset = m_remapped + size();
+            if(_offset + _length > m_file_size)
+            {
+                m_file_size = (_offset + _length + size() - 1) / size() * size();
+                if(ftruncate(m_fd, static_cast<off_t>(m_file_size)) != 0)
+                {
+                    std::cout << "Unable to extend mapped output file: "
+                              << strerror(errno) << std::endl;
+                    return false;
+                }
+            }
+
+            if(mmap(data() + _position, _length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, m_fd,
+                    static_cast<off_t>(_offset)) == MAP_FAILED)
+            {
+                std::cout << "Unable to advance mapped output file: " << strerror(errno)
+                          << std::endl;
+                return false;
+            }
+            m_remapped += _length;
+        }
+        return true;
+    }
+
+    // Cuts the file at end and appends size bytes of data after it. The file is
+    // unmapped first, the ring is backed by anonymous memory from then on, so a
+    // late write cannot reach a page past the end of the file (SIGBUS).
+    void close_file(const size_t& end, const uint8_t* data, const size_t& size)
+    {
+        if(mmap(this->data(), this->size(), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        {
+            std::cout << "Unable to unmap mapped output file: " << strerror(errno)
+                      << std::endl;
+            return;
+        }
+
+        if(ftruncate(m_fd, static_cast<off_t>(end)) != 0 ||
+           (size != 0 && pwrite(m_fd, data, size, static_cast<off_t>(end)) !=
+                             static_cast<ssize_t>(size)))
+        {
+            std::cout << "Error closing mapped output file: " << strerror(errno)
+                      << std::endl;
+        }
+        m_file_size = end + size;
+    }
+
+private:
+    static size_t round_to_pages(const size_t& size)
+    {
+        return (size + page_size() - 1) / page_size() * page_size();
+    }
+
+    mapped_file_buffer_t(int fd, const std::string& filepath, size_t size)
+    : buffer_memory_t(map_file(fd, filepath, size), size,
+                      buffer_allocation_t::mapped_file)
+    , m_fd(fd)
+    , m_file_size(size)
+    {}
+
+    static int open_file(const std::string& filepath)
+    {
+        const int _fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             0644);
+        if(_fd == -1)
+        {
+            std::stringstream _ss;
+            _ss << "Error opening file for writing: " << filepath << " ("
+                << strerror(errno) << ")";
+            throw std::runtime_error(_ss.str());
+        }
+        return _fd;
+    }
+
+    // The descriptor is closed if the file cannot be mapped.
+    static uint8_t* map_file(int fd, const std::string& filepath, const size_t& size)
+    {
+        void* _data = MAP_FAILED;
+        if(ftruncate(fd, static_cast<off_t>(size)) == 0)
+        {
+            _data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if(_data == MAP_FAILED)
+        {
+            std::stringstream _ss;
+            _ss << "Unable to map " << size << " bytes of " << filepath << " ("
+                << strerror(errno) << ")";
+            close(fd);
+            throw std::runtime_error(_ss.str());
+        }
+        return static_cast<uint8_t*>(_data);
     }
+
+    int    m_fd;
+    size_t m_file_size;
+    size_t m_remapped{ 0 };  // pages before this file offset are in their next lap
+};
+
+enum class overrun_policy_t
+{
+    block,        // wait until the flusher frees enough space
+    drop_newest,  // discard the sample that does not fit
+    drop_oldest,  // discard the oldest unflushed samples to make room
+    grow          // spill into an overflow segment that is flushed after the buffer
+};
+
+struct buffered_storage_config_t
+{
+    size_t                    buffer_size{ trace_cache::buffer_size };
+    size_t                    flush_threshold{ trace_cache::flush_threshold };
+    std::chrono::milliseconds flush_interval{ 0 };  // 0 flushes only on demand
+    buffer_allocation_t       allocation{ buffer_allocation_t::mmap };
+    overrun_policy_t          overrun_policy{ overrun_policy_t::block };
+    // Per-thread batching of samples before they reach the buffer, 0 disables it.
+    size_t                    staging_buffer_size{ 0 };
+    // Closes the file with an end-of-stream record on shutdown, so a parser
+    // following the file knows the writer is done.
+    bool                      end_of_stream_marker{ false };
+    // Receives the flushed data instead of the file, e.g. a sample_decoder when
+    // samples are processed in the same process. Called on the flushing thread
+    // with whole records, it must not throw or store into the same storage.
+    consumer_function_t       consumer;
+    // Framed files can be split and skipped through block by block, see
+    // block_header_t. Data handed to a consumer is never framed.
+    file_format_t             file_format{ file_format_t::raw };
+    bool                      block_checksum{ false };
+    // Closes a framed file with an index of the blocks holding each type, so a
+    // parser filtering by type reads only those blocks. Needs the framed file
+    // format and no consumer.
+    bool                      type_index{ false };
+    // Splits the buffer into this many segments instead of using it as a ring,
+    // 0 keeps the ring. Writers fill one segment at a time; a full segment is
+    // handed whole to the flusher and the next free one takes its place. The
+    // flush threshold is not used, every full segment is flushed.
+    size_t                    segment_count{ 0 };
+    // Samples of at least this many bytes, header included, bypass the buffer.
+    // The flusher writes each between the records committed before and after
+    // it. Samples or batches that cannot fit in the buffer or a segment always
+    // take this path, 0 keeps it for them only. Waiting records take up to
+    // buffer_size bytes besides the oldest one, beyond that the overrun policy
+    // applies to them. Not available with a mapped output file.
+    size_t                    out_of_line_size{ 0 };
+};
+
+struct buffered_storage_stats_t
+{
+    size_t dropped_samples{ 0 };
+    size_t overflow_samples{ 0 };
+    size_t out_of_line_samples{ 0 };
 };
 
 template <typename WorkerFactory, typename TypeIdentifierEnum>
@@ -152,14 +503,100 @@ class buffered_storage
     static_assert(type_traits::is_enum_class_v<TypeIdentifierEnum>,
                   "TypeIdentifierEnum must be an enum class");
 
+    struct reserved_space_t
+    {
+        uint8_t* data;
+        size_t   begin;  // head before the reservation, including any wrap padding
+        size_t   end;    // head after the reservation
+        bool     overflow{ false };     // no space given, the records are spilled
+        bool     out_of_line{ false };  // the records are written out of line
+    };
+
 public:
-    explicit buffered_storage(std::string filepath)
-    : m_worker{ std::move(
-          WorkerFactory::get_worker([this](ofs_t& ofs, bool force) { flush(ofs, force); },
-                                    m_worker_synchronization, std::move(filepath))) }
-    {}
+    // With a consumer configured no file is written and filepath is not used. A
+    // mapped output file is written by the storage itself, not the worker.
+    explicit buffered_storage(std::string filepath, buffered_storage_config_t config = {})
+    : m_config{ std::move(config) }
+    , m_mapped_filepath{ m_config.allocation == buffer_allocation_t::mapped_file
+                             ? filepath
+                             : std::string{} }
+    , m_worker{ std::move(WorkerFactory::get_worker(
+          [this](sink_t& sink, bool force) { flush(sink, force); },
+          m_worker_synchronization,
+          m_config.consumer || !m_mapped_filepath.empty() ? std::string{}
+                                                          : std::move(filepath))) }
+    , m_buffer{ m_config.allocation == buffer_allocation_t::mapped_file
+                    ? nullptr
+                    : std::make_unique<buffer_memory_t>(m_config.buffer_size,
+                                                        m_config.allocation) }
+    , m_segment_count{ m_config.segment_count }
+    , m_segment_size{ m_segment_count != 0 ? m_config.buffer_size / m_segment_count
+                                           : 0 }
+    , m_segments{ std::make_unique<segment_t[]>(m_segment_count) }
+    {
+        if(m_config.allocation == buffer_allocation_t::mapped_file)
+        {
+            // Everything stored has to land in the ring in file order.
+            if(m_mapped_filepath.empty() || m_config.consumer ||
+               m_config.file_format != file_format_t::raw ||
+               m_config.overrun_policy == overrun_policy_t::drop_oldest ||
+               m_config.overrun_policy == overrun_policy_t::grow ||
+               m_config.out_of_line_size != 0)
+            {
+                throw std::runtime_error(
+                    "A mapped output file needs a filepath, the raw file format, the "
+                    "block or drop_newest overrun policy and no out-of-line records.");
+            }
+        }
+
+        // The index points at file offsets of blocks.
+        if(m_config.type_index &&
+           (m_config.file_format != file_format_t::framed || m_config.consumer))
+        {
+            throw std::runtime_error(
+                "A type index needs the framed file format and no consumer.");
+        }
+
+        if(m_config.buffer_size <= header_size<TypeIdentifierEnum>)
+        {
+            throw std::runtime_error("Buffer is too small to hold any sample.");
+        }
+        if(m_segment_count != 0)
+        {
+            if(m_segment_size <= header_size<TypeIdentifierEnum> ||
+               m_segment_size > segment_offset_mask ||
+               m_config.staging_buffer_size > m_segment_size ||
+               !m_mapped_filepath.empty())
+            {
+                throw std::runtime_error(
+                    "Buffer segments must hold a sample and the staging buffer, be "
+                    "smaller than 2 GiB and cannot be a mapped output file.");
+            }
+            for(size_t i = 0; i < m_segment_count; ++i)
+            {
+                m_segments[i].state.store(make_segment_state(i, 0));
+            }
+        }
+        if(m_config.staging_buffer_size + header_size<TypeIdentifierEnum> >
+           m_config.buffer_size)
+        {
+            throw std::runtime_error("Staging buffer must be smaller than the buffer.");
+        }
+
+        m_worker_synchronization->flush_interval = m_config.flush_interval;
+    }
+
+    ~buffered_storage()
+    {
+        shutdown();
 
-    ~buffered_storage() { shutdown(); }
+        std::lock_guard _lock{ m_staging_mutex };
+        for(auto& _staging : m_staging_buffers)
+        {
+            std::lock_guard _staging_lock{ _staging->mutex };
+            _staging->owner = nullptr;
+        }
+    }
 
     void start(const pid_t& current_pid = getpid())
     {
@@ -172,6 +609,25 @@ public:
             return;
         }
 
+        {
+            // Every start begins a new file.
+            std::lock_guard _lock{ m_mutex };
+            m_file_offset   = 0;
+            m_next_sequence = 0;
+            m_type_index.clear();
+
+            if(!m_mapped_filepath.empty())
+            {
+                m_buffer.reset();
+                auto _mapped_file = std::make_unique<mapped_file_buffer_t>(
+                    m_mapped_filepath, m_config.buffer_size);
+                m_mapped_file = _mapped_file.get();
+                m_buffer      = std::move(_mapped_file);
+                m_head.store(0);
+                m_commit.store(0);
+                m_tail.store(0);
+            }
+        }
         m_worker->start(current_pid);
     }
 
@@ -187,9 +643,96 @@ public:
             return;
         }
 
+        {
+            std::lock_guard _lock{ m_staging_mutex };
+            for(auto& _staging : m_staging_buffers)
+            {
+                std::lock_guard _staging_lock{ _staging->mutex };
+                publish_staging_buffer(*_staging);
+            }
+        }
+
+        // The final flush writes the end marker and index, after all remaining
+        // samples.
+        m_close_pending.store(true);
         m_worker->stop(current_pid);
+
+        const auto _stats = stats();
+        if(_stats.dropped_samples != 0 || _stats.overflow_samples != 0)
+        {
+            std::cout << "Buffer storage dropped " << _stats.dropped_samples
+                      << " samples and spilled " << _stats.overflow_samples
+                      << " samples into overflow segment." << std::endl;
+        }
+    }
+
+    buffered_storage_stats_t stats() const
+    {
+        return { m_dropped_samples.load(std::memory_order_relaxed),
+                 m_overflow_samples.load(std::memory_order_relaxed),
+                 m_out_of_line_samples.load(std::memory_order_relaxed) };
     }
 
+    // Writable space for a single sample, obtained from reserve(). The payload
+    // becomes visible to the flusher on commit(). A reservation destroyed
+    // without commit() is turned into fragmented space, which the parser skips.
+    class reservation_t
+    {
+    public:
+        reservation_t(const reservation_t&)            = delete;
+        reservation_t& operator=(const reservation_t&) = delete;
+        reservation_t& operator=(reservation_t&&)      = delete;
+
+        reservation_t(reservation_t&& other) noexcept
+        : m_storage(std::exchange(other.m_storage, nullptr))
+        , m_space(other.m_space)
+        , m_record(other.m_record)
+        , m_data(other.m_data)
+        , m_size(other.m_size)
+        , m_fallback(std::move(other.m_fallback))
+        {}
+
+        ~reservation_t()
+        {
+            if(m_storage != nullptr)
+            {
+                std::exchange(m_storage, nullptr)->release_reservation(*this, false);
+            }
+        }
+
+        uint8_t* data() const { return m_data; }
+        size_t   size() const { return m_size; }
+
+        void commit()
+        {
+            if(m_storage == nullptr)
+            {
+                throw std::runtime_error("Reservation is already committed.");
+            }
+            std::exchange(m_storage, nullptr)->release_reservation(*this, true);
+        }
+
+    private:
+        friend class buffered_storage;
+
+        reservation_t(buffered_storage* storage, const reserved_space_t& space,
+                      uint8_t* record, size_t size, std::vector<uint8_t> fallback)
+        : m_storage(storage)
+        , m_space(space)
+        , m_record(record)
+        , m_data(record + header_size<TypeIdentifierEnum>)
+        , m_size(size)
+        , m_fallback(std::move(fallback))
+        {}
+
+        buffered_storage*    m_storage;
+        reserved_space_t     m_space;
+        uint8_t*             m_record;
+        uint8_t*             m_data;
+        size_t               m_size;
+        std::vector<uint8_t> m_fallback;
+    };
+
     template <typename Type>
     auto store(const Type& value)
     {
@@ -202,106 +745,1462 @@ public:
 
         type_traits::check_type<Type, TypeIdentifierEnum>();
 
-        using TypeIdentifierEnumUderlayingType =
-            std::underlying_type_t<TypeIdentifierEnum>;
-
         size_t sample_size      = get_size(value);
         size_t bytes_to_reserve = header_size<TypeIdentifierEnum> + sample_size;
-        auto*  buf              = reserve_memory_space(bytes_to_reserve);
-        size_t position         = 0;
-        auto   type_identifier_value =
-            static_cast<TypeIdentifierEnumUderlayingType>(Type::type_identifier);
 
-        utility::store_value(type_identifier_value, buf, position);
-        utility::store_value(sample_size, buf, position);
-        serialize(buf + position, value);
+        auto _writer = [&](uint8_t* buf) { write_sample(buf, sample_size, value); };
+        if(__builtin_expect(exceeds_out_of_line_size(bytes_to_reserve), 0))
+        {
+            // Staged samples of this thread must land before this one.
+            flush_staging_buffer();
+            store_out_of_line(bytes_to_reserve, 1, _writer);
+            return;
+        }
+
+        store_records(bytes_to_reserve, 1, _writer);
     }
 
-private:
-    void flush(ofs_t& ofs, bool force)
+    // Stores all samples in [first, last) with a single reservation. Samples are
+    // written contiguously, in order, and are never interleaved with samples of
+    // other threads.
+    template <typename Iterator,
+              typename = std::enable_if_t<type_traits::has_type_identifier<
+                  typename std::iterator_traits<Iterator>::value_type,
+                  TypeIdentifierEnum>::value>>
+    void store_batch(Iterator first, Iterator last)
     {
-        size_t _head, _tail;
-        {
-            std::lock_guard guard{ m_mutex };
-            _head = m_head;
-            _tail = m_tail;
+        using type_t = typename std::iterator_traits<Iterator>::value_type;
 
-            if(_head == _tail)
-            {
-                return;
-            }
-
-            auto used_space =
-                m_head > m_tail ? (m_head - m_tail) : (buffer_size - m_tail + m_head);
-            if(!force && used_space < flush_threshold)
-            {
-                return;
-            }
-            m_tail = m_head;
+        if(!is_running())
+        {
+            throw std::runtime_error(
+                "Trying to use buffered storage while it is not running");
         }
 
-        if(_head > _tail)
+        type_traits::check_type<type_t, TypeIdentifierEnum>();
+
+        size_t number_of_samples = 0;
+        size_t bytes_to_reserve  = 0;
+        for(auto it = first; it != last; ++it)
         {
-            ofs.write(reinterpret_cast<const char*>(m_buffer->data() + _tail),
-                      _head - _tail);
+            bytes_to_reserve += header_size<TypeIdentifierEnum> + get_size(*it);
+            number_of_samples++;
         }
-        else
+
+        if(number_of_samples == 0)
         {
-            ofs.write(reinterpret_cast<const char*>(m_buffer->data() + _tail),
-                      buffer_size - _tail);
-            ofs.write(reinterpret_cast<const char*>(m_buffer->data()), _head);
+            return;
         }
+
+        store_records(bytes_to_reserve, number_of_samples, [&](uint8_t* buf) {
+            for(auto it = first; it != last; ++it)
+            {
+                size_t sample_size = get_size(*it);
+                write_sample(buf, sample_size, *it);
+                buf += header_size<TypeIdentifierEnum> + sample_size;
+            }
+        });
     }
 
-    void fragment_memory()
+    template <typename Container,
+              typename = decltype(std::begin(std::declval<const Container&>()))>
+    void store_batch(const Container& samples)
     {
-        auto* _data = m_buffer->data();
-        memset(_data + m_head, 0xFFFF, buffer_size - m_head);
-        *reinterpret_cast<TypeIdentifierEnum*>(_data + m_head) =
-            TypeIdentifierEnum::fragmented_space;
-
-        size_t remaining_bytes = buffer_size - m_head - header_size<TypeIdentifierEnum>;
-        *reinterpret_cast<size_t*>(_data + m_head + sizeof(TypeIdentifierEnum)) =
-            remaining_bytes;
-        m_head = 0;
+        store_batch(std::begin(samples), std::end(samples));
     }
 
-    __attribute__((always_inline)) inline uint8_t* reserve_memory_space(
-        const size_t& number_of_bytes)
+    // Stores samples of possibly different types with a single reservation.
+    template <typename... Types,
+              typename = std::enable_if_t<
+                  (sizeof...(Types) != 0) &&
+                  (type_traits::has_type_identifier<Types, TypeIdentifierEnum>::value &&
+                   ...)>>
+    void store_batch(const Types&... values)
     {
-        size_t _size;
+        if(!is_running())
         {
-            std::lock_guard scope{ m_mutex };
+            throw std::runtime_error(
+                "Trying to use buffered storage while it is not running");
+        }
 
-            if(__builtin_expect((m_head + number_of_bytes +
-                                 header_size<TypeIdentifierEnum>) > buffer_size,
-                                0))
-            {
-                fragment_memory();
-            }
-            _size = m_head;
-            m_head += number_of_bytes;
+        (type_traits::check_type<Types, TypeIdentifierEnum>(), ...);
+
+        const std::array<size_t, sizeof...(Types)> _sizes{ get_size(values)... };
+
+        size_t bytes_to_reserve = sizeof...(Types) * header_size<TypeIdentifierEnum>;
+        for(const auto& _size : _sizes)
+        {
+            bytes_to_reserve += _size;
         }
 
-        return m_buffer->data() + _size;
+        store_records(bytes_to_reserve, sizeof...(Types), [&](uint8_t* buf) {
+            size_t _index = 0;
+            ((write_sample(buf, _sizes[_index], values),
+              buf += header_size<TypeIdentifierEnum> + _sizes[_index++]),
+             ...);
+        });
     }
 
-    __attribute__((always_inline)) inline bool is_running() const
+    // Reserves space for one sample of Type with a payload of payload_size bytes
+    // so it can be serialized in place. The payload must use the layout expected
+    // by Type's deserialization. Samples are flushed in reservation order, so a
+    // pending reservation holds back every later one: a thread must commit its
+    // reservation before it reserves or stores again, or it deadlocks.
+    template <typename Type>
+    reservation_t reserve(const size_t& payload_size)
     {
-        return m_worker_synchronization->is_running;
-    }
+        if(!is_running())
+        {
+            throw std::runtime_error(
+                "Trying to use buffered storage while it is not running");
+        }
 
-private:
-    worker_synchronization_ptr_t m_worker_synchronization{
-        std::make_shared<worker_synchronization_t>()
-    };
+        type_traits::check_type<Type, TypeIdentifierEnum>();
 
-    std::shared_ptr<typename WorkerFactory::worker_t> m_worker;
+        // Staged samples of this thread must land before the reserved one.
+        flush_staging_buffer();
+
+        const size_t bytes_to_reserve = header_size<TypeIdentifierEnum> + payload_size;
+        auto         space            = exceeds_out_of_line_size(bytes_to_reserve)
+                                            ? reserve_out_of_line()
+                                            : reserve_memory_space(bytes_to_reserve);
+        uint8_t*     record           = space.data;
+
+        std::vector<uint8_t> fallback;
+
+        if(__builtin_expect(record == nullptr, 0))
+        {
+            // No room in the ring or an out-of-line sample, it is written aside
+            // and then stored out of line, spilled or dropped on commit.
+            fallback.resize(bytes_to_reserve);
+            record = fallback.data();
+        }
+
+        *reinterpret_cast<TypeIdentifierEnum*>(record) = Type::type_identifier;
+        *reinterpret_cast<size_t*>(record + sizeof(TypeIdentifierEnum)) = payload_size;
+
+        return reservation_t{ this, space, record, payload_size, std::move(fallback) };
+    }
+
+    // Publishes samples staged by the calling thread. Staged samples are also
+    // published when the thread exits and on shutdown.
+    void flush_staging_buffer()
+    {
+        if(m_config.staging_buffer_size == 0)
+        {
+            return;
+        }
+
+        auto&           _staging = get_staging_buffer();
+        std::lock_guard _lock{ _staging.mutex };
+        publish_staging_buffer(_staging);
+    }
+
+private:
+    struct staging_buffer_t
+    {
+        std::mutex           mutex;
+        buffered_storage*    owner{ nullptr };
+        std::vector<uint8_t> data;
+        size_t               used{ 0 };
+        size_t               samples{ 0 };
+    };
+    using staging_buffer_ptr_t = std::shared_ptr<staging_buffer_t>;
+
+    struct out_of_line_record_t
+    {
+        size_t               position{ 0 };  // see store_out_of_line
+        size_t               offset{ 0 };    // in the segment, segmented buffers only
+        size_t               samples{ 0 };
+        std::vector<uint8_t> data;
+    };
+
+    // Staging buffers of the current thread, published on thread exit if their
+    // storage is still alive.
+    struct thread_staging_buffers_t
+    {
+        ~thread_staging_buffers_t()
+        {
+            for(auto& _buffer : buffers)
+            {
+                auto&           _staging = *_buffer.second;
+                std::lock_guard _lock{ _staging.mutex };
+                if(_staging.owner == nullptr)
+                {
+                    continue;
+                }
+
+                try
+                {
+                    _staging.owner->publish_staging_buffer(_staging);
+                } catch(const std::exception& e)
+                {
+                    std::cout << "Unable to publish staged samples on thread exit: "
+                              << e.what() << std::endl;
+                }
+
+                // The storage drops the detached buffer from its list when the
+                // next thread adds one. Taking m_staging_mutex here would invert
+                // the lock order of shutdown.
+                _staging.owner = nullptr;
+                std::vector<uint8_t>{}.swap(_staging.data);
+            }
+        }
+
+        std::vector<std::pair<size_t, staging_buffer_ptr_t>> buffers;
+    };
+
+    staging_buffer_t& get_staging_buffer()
+    {
+        static thread_local thread_staging_buffers_t _thread_buffers;
+
+        auto& _buffers = _thread_buffers.buffers;
+        for(auto& _buffer : _buffers)
+        {
+            if(_buffer.first == m_id)
+            {
+                return *_buffer.second;
+            }
+        }
+
+        // Forget buffers of storages that no longer exist before adding a new one.
+        _buffers.erase(std::remove_if(_buffers.begin(), _buffers.end(),
+                                      [](auto& _buffer) {
+                                          std::lock_guard _lock{ _buffer.second->mutex };
+                                          return _buffer.second->owner == nullptr;
+                                      }),
+                       _buffers.end());
+
+        auto _staging   = std::make_shared<staging_buffer_t>();
+        _staging->owner = this;
+        _staging->data.resize(m_config.staging_buffer_size);
+        {
+            std::lock_guard _lock{ m_staging_mutex };
+            m_staging_buffers.erase(
+                std::remove_if(m_staging_buffers.begin(), m_staging_buffers.end(),
+                               [](auto& _buffer) {
+                                   std::lock_guard _lock{ _buffer->mutex };
+                                   return _buffer->owner == nullptr;
+                               }),
+                m_staging_buffers.end());
+            m_staging_buffers.push_back(_staging);
+        }
+        _buffers.emplace_back(m_id, _staging);
+        return *_staging;
+    }
+
+    // Moves all staged samples into the ring buffer with a single reservation.
+    // Caller must hold the staging buffer mutex.
+    void publish_staging_buffer(staging_buffer_t& staging)
+    {
+        if(staging.used == 0)
+        {
+            return;
+        }
+
+        if(!is_running())
+        {
+            m_dropped_samples.fetch_add(staging.samples, std::memory_order_relaxed);
+            staging.used    = 0;
+            staging.samples = 0;
+            return;
+        }
+
+        store_in_buffer(staging.used, staging.samples, [&](uint8_t* buf) {
+            std::memcpy(buf, staging.data.data(), staging.used);
+        });
+        staging.used    = 0;
+        staging.samples = 0;
+    }
+
+    // Routes records through the staging buffer of the calling thread when
+    // staging is enabled. Records that do not fit in the staging buffer are
+    // stored directly, after the staged ones, so the thread order is kept.
+    template <typename Writer>
+    __attribute__((always_inline)) inline void store_records(
+        const size_t& number_of_bytes, const size_t& number_of_samples, Writer&& writer)
+    {
+        if(m_config.staging_buffer_size == 0)
+        {
+            store_in_buffer(number_of_bytes, number_of_samples,
+                            std::forward<Writer>(writer));
+            return;
+        }
+
+        auto&           _staging = get_staging_buffer();
+        std::lock_guard _lock{ _staging.mutex };
+
+        if(_staging.used + number_of_bytes > _staging.data.size())
+        {
+            publish_staging_buffer(_staging);
+        }
+
+        if(number_of_bytes > _staging.data.size())
+        {
+            store_in_buffer(number_of_bytes, number_of_samples,
+                            std::forward<Writer>(writer));
+            return;
+        }
+
+        writer(_staging.data.data() + _staging.used);
+        _staging.used += number_of_bytes;
+        _staging.samples += number_of_samples;
+    }
+
+    template <typename Writer>
+    __attribute__((always_inline)) inline void store_in_buffer(
+        const size_t& number_of_bytes, const size_t& number_of_samples, Writer&& writer)
+    {
+        auto space = reserve_memory_space(number_of_bytes);
+
+        if(__builtin_expect(space.data == nullptr, 0))
+        {
+            if(space.out_of_line)
+            {
+                store_out_of_line(number_of_bytes, number_of_samples,
+                                  std::forward<Writer>(writer));
+                return;
+            }
+            if(!space.overflow)
+            {
+                m_dropped_samples.fetch_add(number_of_samples, std::memory_order_relaxed);
+                return;
+            }
+
+            spill_to_overflow(number_of_bytes, number_of_samples,
+                              std::forward<Writer>(writer));
+            return;
+        }
+
+        writer(space.data);
+        commit_memory_space(space);
+        signal_threshold(space);
+    }
+
+    void release_reservation(reservation_t& reservation, bool keep)
+    {
+        const auto& _space = reservation.m_space;
+        if(_space.data == nullptr)
+        {
+            if(!keep)
+            {
+                return;
+            }
+
+            const auto& _fallback = reservation.m_fallback;
+            auto        _writer   = [&](uint8_t* buf) {
+                std::memcpy(buf, _fallback.data(), _fallback.size());
+            };
+            if(_space.out_of_line)
+            {
+                store_out_of_line(_fallback.size(), 1, _writer);
+                return;
+            }
+            if(!_space.overflow)
+            {
+                m_dropped_samples.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            spill_to_overflow(_fallback.size(), 1, _writer);
+            return;
+        }
+
+        if(!keep)
+        {
+            *reinterpret_cast<TypeIdentifierEnum*>(reservation.m_record) =
+                TypeIdentifierEnum::fragmented_space;
+            clear_fragment_payload(reservation.m_data, reservation.m_size);
+        }
+        commit_memory_space(_space);
+        signal_threshold(_space);
+    }
+
+    template <typename Writer>
+    void spill_to_overflow(const size_t& number_of_bytes,
+                           const size_t& number_of_samples,
+                           Writer&&      writer)
+    {
+        std::lock_guard _lock{ m_overflow_mutex };
+        auto            _offset = m_overflow.size();
+        m_overflow.resize(_offset + number_of_bytes);
+        writer(m_overflow.data() + _offset);
+        m_overflow_active.store(true, std::memory_order_release);
+        m_overflow_samples.fetch_add(number_of_samples, std::memory_order_relaxed);
+    }
+
+    // The records are serialized aside and queued with their place in the
+    // stream: the commit cursor of the ring, or the active segment and the
+    // offset reserved in it. Writers keep using the buffer meanwhile. While
+    // the grow policy spills into the overflow segment, the records follow the
+    // samples spilled before them there.
+    template <typename Writer>
+    void store_out_of_line(const size_t& number_of_bytes,
+                           const size_t& number_of_samples,
+                           Writer&&      writer)
+    {
+        out_of_line_record_t _record{ 0, 0, number_of_samples,
+                                      std::vector<uint8_t>(number_of_bytes) };
+        writer(_record.data.data());
+
+        if(m_config.overrun_policy == overrun_policy_t::grow)
+        {
+            std::lock_guard _lock{ m_overflow_mutex };
+            if(m_overflow_active.load(std::memory_order_relaxed))
+            {
+                m_overflow.insert(m_overflow.end(), _record.data.begin(),
+                                  _record.data.end());
+                m_overflow_samples.fetch_add(number_of_samples,
+                                             std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        std::unique_lock _lock{ m_out_of_line_mutex };
+        while(!m_out_of_line.empty() &&
+              m_out_of_line_bytes + number_of_bytes > m_config.buffer_size &&
+              m_config.overrun_policy != overrun_policy_t::grow)
+        {
+            if(m_config.overrun_policy == overrun_policy_t::drop_newest)
+            {
+                m_dropped_samples.fetch_add(number_of_samples, std::memory_order_relaxed);
+                return;
+            }
+            if(m_config.overrun_policy == overrun_policy_t::drop_oldest)
+            {
+                auto& _oldest = m_out_of_line.front();
+                m_dropped_samples.fetch_add(_oldest.samples, std::memory_order_relaxed);
+                m_out_of_line_bytes -= _oldest.data.size();
+                m_out_of_line.pop_front();
+                continue;
+            }
+
+            _lock.unlock();
+            if(!is_running())
+            {
+                throw std::runtime_error(
+                    "Buffered storage stopped while waiting for free space");
+            }
+            request_flush();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            _lock.lock();
+        }
+
+        if(m_segment_count == 0)
+        {
+            _record.position = m_commit.load(std::memory_order_acquire);
+        }
+        else
+        {
+            std::tie(_record.position, _record.offset) = segment_position();
+        }
+        m_out_of_line_bytes += number_of_bytes;
+        m_out_of_line.push_back(std::move(_record));
+        m_out_of_line_pending.store(true, std::memory_order_release);
+        _lock.unlock();
+
+        m_out_of_line_samples.fetch_add(number_of_samples, std::memory_order_relaxed);
+        request_flush();
+    }
+
+    // The active segment and the offset reserved in it so far, every record
+    // the calling thread stored before is in front of it. A sealed or flushed
+    // segment is followed by the start of the next one.
+    std::pair<size_t, size_t> segment_position()
+    {
+        const size_t   _active = m_active_segment.load(std::memory_order_acquire);
+        const uint64_t _state  = segment(_active).state.load(std::memory_order_acquire);
+        if(in_generation(_state, _active) && (_state & segment_sealed) == 0)
+        {
+            return { _active, _state & segment_offset_mask };
+        }
+        return { _active + 1, 0 };
+    }
+
+    // Takes the oldest out-of-line record off the queue if reached says its
+    // place in the stream is written. Caller must hold m_mutex.
+    template <typename Reached>
+    bool next_out_of_line(out_of_line_record_t& record, Reached&& reached)
+    {
+        if(!m_out_of_line_pending.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        std::lock_guard _lock{ m_out_of_line_mutex };
+        if(m_out_of_line.empty() || !reached(m_out_of_line.front()))
+        {
+            return false;
+        }
+
+        record = std::move(m_out_of_line.front());
+        m_out_of_line.pop_front();
+        m_out_of_line_bytes -= record.data.size();
+        m_out_of_line_pending.store(!m_out_of_line.empty(), std::memory_order_release);
+        return true;
+    }
+
+    // Every out-of-line record is a block of its own.
+    void write_out_of_line(sink_t& sink, out_of_line_record_t& record)
+    {
+        segments_t _segments;
+        _segments.add(record.data.data(), record.data.size());
+        write_block(sink, _segments);
+    }
+
+    // Wakes the flusher once the committed data crosses the flush threshold.
+    __attribute__((always_inline)) inline void signal_threshold(
+        const reserved_space_t& space)
+    {
+        if(m_segment_count != 0)
+        {
+            return;
+        }
+
+        const size_t _tail = m_tail.load(std::memory_order_relaxed);
+        const size_t _used =
+            space.end >= _tail ? space.end - _tail : m_buffer->size() - _tail + space.end;
+        if(__builtin_expect(_used >= m_config.flush_threshold, 0) &&
+           !m_threshold_signaled.load(std::memory_order_relaxed) &&
+           !m_threshold_signaled.exchange(true, std::memory_order_relaxed))
+        {
+            m_worker_synchronization->request_flush();
+        }
+    }
+
+    // Forces the next flush regardless of the threshold and wakes the flusher.
+    void request_flush()
+    {
+        if(!m_flush_requested.exchange(true, std::memory_order_relaxed))
+        {
+            m_worker_synchronization->request_flush();
+        }
+    }
+
+    template <typename Type>
+    __attribute__((always_inline)) inline static void write_sample(
+        uint8_t* buf, const size_t& sample_size, const Type& value)
+    {
+        using TypeIdentifierEnumUderlayingType =
+            std::underlying_type_t<TypeIdentifierEnum>;
+
+        size_t position = 0;
+        auto   type_identifier_value =
+            static_cast<TypeIdentifierEnumUderlayingType>(Type::type_identifier);
+
+        utility::store_value(type_identifier_value, buf, position);
+        utility::store_value(sample_size, buf, position);
+        serialize(buf + position, value);
+    }
+
+    void flush(sink_t& sink, bool force)
+    {
+        std::lock_guard _lock{ m_mutex };
+
+        // The mapped file is cut on close, no writer may still be serializing
+        // into it.
+        if(m_mapped_file != nullptr && m_worker_synchronization->closing)
+        {
+            while(m_commit.load(std::memory_order_acquire) !=
+                  m_head.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        // Overflow samples were stored after everything committed so far, so the
+        // buffer content has to be written out before them.
+        std::vector<uint8_t> _overflow;
+        bool _overflow_active = m_overflow_active.load(std::memory_order_acquire);
+        if(_overflow_active)
+        {
+            std::lock_guard _overflow_lock{ m_overflow_mutex };
+            _overflow.swap(m_overflow);
+        }
+
+        const bool _requested   = m_flush_requested.exchange(false);
+        const bool _out_of_line = m_out_of_line_pending.load(std::memory_order_acquire);
+        if(m_segment_count != 0 &&
+           !write_segments(sink, force || _requested || _overflow_active) &&
+           _overflow_active && !force)
+        {
+            // A segment holding earlier samples waits for a pending reservation,
+            // the overflow samples wait with it.
+            std::lock_guard _overflow_lock{ m_overflow_mutex };
+            _overflow.insert(_overflow.end(), m_overflow.begin(), m_overflow.end());
+            _overflow.swap(m_overflow);
+            _overflow.clear();
+            _overflow_active = false;
+        }
+
+        // A segmented buffer leaves the ring cursors at 0.
+        const size_t _head = m_commit.load(std::memory_order_acquire);
+        const size_t _tail = m_tail.load(std::memory_order_relaxed);
+
+        const size_t _capacity = m_buffer->size();
+        auto used_space = _head >= _tail ? (_head - _tail) : (_capacity - _tail + _head);
+        bool _flush_buffer =
+            used_space != 0 && (force || _requested || _overflow_active || _out_of_line ||
+                                used_space >= m_config.flush_threshold);
+
+        // Out-of-line records go between the ring data committed before and after
+        // them, the ring data before each one is a block of its own.
+        size_t               _from = _tail;
+        out_of_line_record_t _record;
+        while(m_segment_count == 0 && (_flush_buffer || used_space == 0) &&
+              next_out_of_line(_record, [&](const out_of_line_record_t& record) {
+                  return ring_distance(_tail, record.position) <= used_space;
+              }))
+        {
+            segments_t _before;
+            add_ring_range(_before, _from, _record.position);
+            write_block(sink, _before);
+            write_out_of_line(sink, _record);
+            _from = _record.position;
+        }
+
+        // Everything else written by one flush ends up in a single block, buffer
+        // segments are blocks of their own.
+        segments_t _segments;
+        if(_flush_buffer)
+        {
+            add_ring_range(_segments, _from, _head);
+        }
+
+        if(_overflow_active)
+        {
+            _segments.add(_overflow.data(), _overflow.size());
+        }
+
+        const bool _close =
+            m_worker_synchronization->closing && m_close_pending.exchange(false);
+        std::array<uint8_t, header_size<TypeIdentifierEnum> + sizeof(uint64_t)> _marker;
+        if(_close && m_config.end_of_stream_marker)
+        {
+            *reinterpret_cast<TypeIdentifierEnum*>(_marker.data()) =
+                TypeIdentifierEnum::fragmented_space;
+            *reinterpret_cast<size_t*>(_marker.data() + sizeof(TypeIdentifierEnum)) =
+                sizeof(uint64_t);
+            *reinterpret_cast<uint64_t*>(_marker.data() +
+                                         header_size<TypeIdentifierEnum>) =
+                end_of_stream_magic;
+            _segments.add(_marker.data(), _marker.size());
+        }
+
+        if(m_mapped_file != nullptr)
+        {
+            // The records are in the file already, only the flushed end moves.
+            // Until it does, writers are kept out of the flushed range.
+            if(_flush_buffer)
+            {
+                _flush_buffer = m_mapped_file->flush(m_file_offset + used_space);
+                m_file_offset += _flush_buffer ? used_space : 0;
+            }
+            if(_close)
+            {
+                const bool _marker_written = m_config.end_of_stream_marker;
+                m_mapped_file->close_file(m_file_offset, _marker.data(),
+                                          _marker_written ? _marker.size() : 0);
+            }
+        }
+        else
+        {
+            write_block(sink, _segments);
+            if(_close && m_config.type_index)
+            {
+                write_type_index(sink);
+            }
+        }
+
+        if(_flush_buffer)
+        {
+            m_tail.store(_head, std::memory_order_release);
+            m_threshold_signaled.store(false, std::memory_order_relaxed);
+        }
+
+        if(_overflow_active)
+        {
+            std::lock_guard _overflow_lock{ m_overflow_mutex };
+            if(m_overflow.empty())
+            {
+                m_overflow_active.store(false, std::memory_order_release);
+            }
+        }
+
+        // Hand written data to the file right away, so it can be followed live.
+        sink.flush();
+    }
+
+    // Writes every complete buffer segment, oldest first. With seal the partly
+    // filled active segment is closed first, so everything committed so far is
+    // written. A segment with a pending reservation waits for the next flush.
+    // Returns true if no segment with data is left unwritten.
+    bool write_segments(sink_t& sink, bool seal)
+    {
+        const size_t _active = m_active_segment.load(std::memory_order_acquire);
+        if(seal)
+        {
+            auto&    _segment = segment(_active);
+            uint64_t _state   = _segment.state.load(std::memory_order_acquire);
+            while(in_generation(_state, _active) &&
+                  (_state & segment_sealed) == 0 && (_state & segment_offset_mask) != 0 &&
+                  !_segment.state.compare_exchange_weak(_state, _state | segment_sealed,
+                                                        std::memory_order_acq_rel))
+            {}
+        }
+
+        // Out-of-line records go between the data reserved in their segment
+        // before and after them, the data before each one is a block of its own.
+        size_t               _flushed = m_flushed_segments.load(std::memory_order_relaxed);
+        out_of_line_record_t _record;
+        auto                 _reached = [&](const out_of_line_record_t& record) {
+            return record.position < _flushed ||
+                   (record.position == _flushed && record.offset == 0);
+        };
+        while(next_out_of_line(_record, _reached))
+        {
+            write_out_of_line(sink, _record);
+        }
+
+        for(; _flushed <= _active && segment_complete(_flushed);)
+        {
+            const size_t _size =
+                segment(_flushed).state.load(std::memory_order_relaxed) &
+                segment_offset_mask;
+
+            size_t _from = 0;
+            while(next_out_of_line(_record, [&](const out_of_line_record_t& record) {
+                return record.position <= _flushed;
+            }))
+            {
+                const size_t _offset = std::max(_record.offset, _from);
+                segments_t   _before;
+                _before.add(segment_data(_flushed) + _from, _offset - _from);
+                write_block(sink, _before);
+                write_out_of_line(sink, _record);
+                _from = _offset;
+            }
+
+            segments_t _segments;
+            _segments.add(segment_data(_flushed) + _from, _size - _from);
+            write_block(sink, _segments);
+            release_segment(_flushed++);
+
+            while(next_out_of_line(_record, _reached))
+            {
+                write_out_of_line(sink, _record);
+            }
+        }
+
+        const bool _drained =
+            _flushed > _active ||
+            (_flushed == _active &&
+             (segment(_active).state.load(std::memory_order_acquire) &
+              segment_offset_mask) == 0);
+
+        // Writers may be waiting for a free segment.
+        advance_segment(_active);
+        return _drained;
+    }
+
+    // Up to two ranges of the buffer, the overflow segment and the end marker.
+    struct segments_t
+    {
+        void add(uint8_t* data, const size_t& size)
+        {
+            if(size != 0)
+            {
+                ranges[count++] = { data, size };
+            }
+        }
+
+        std::array<std::pair<uint8_t*, size_t>, 4> ranges;
+        size_t                                     count{ 0 };
+    };
+
+    // Distance from tail to position in ring order.
+    size_t ring_distance(const size_t& tail, const size_t& position) const
+    {
+        return position >= tail ? position - tail : m_buffer->size() - tail + position;
+    }
+
+    // The ring data committed between from and to, split at the end of the buffer.
+    void add_ring_range(segments_t& segments, const size_t& from, const size_t& to)
+    {
+        if(to >= from)
+        {
+            segments.add(m_buffer->data() + from, to - from);
+        }
+        else
+        {
+            segments.add(m_buffer->data() + from, m_buffer->size() - from);
+            segments.add(m_buffer->data(), to);
+        }
+    }
+
+    // Ranges always hold whole records, the commit cursor and the overflow segment
+    // only ever advance by complete records. The block goes to the sink in one
+    // write, header included.
+    void write_block(sink_t& sink, const segments_t& segments, const uint32_t& flags = 0)
+    {
+        if(segments.count == 0)
+        {
+            return;
+        }
+
+        if(m_config.consumer)
+        {
+            for(size_t i = 0; i < segments.count; ++i)
+            {
+                m_config.consumer(segments.ranges[i].first, segments.ranges[i].second);
+            }
+            return;
+        }
+
+        std::array<iovec, std::tuple_size_v<decltype(segments.ranges)> + 1> _ranges;
+        size_t                                                              _count = 0;
+
+        block_header_t _header;
+        if(m_config.file_format == file_format_t::framed)
+        {
+            const bool     _records = (flags & block_flag_index) == 0;
+            for(size_t i = 0; i < segments.count; ++i)
+            {
+                const auto& [_data, _size] = segments.ranges[i];
+                _header.length += _size;
+                if(_records)
+                {
+                    _header.record_count += index_records(_data, _size);
+                }
+                if(m_config.block_checksum)
+                {
+                    _header.checksum = utility::crc32c(_data, _size, _header.checksum);
+                }
+            }
+            _header.flags = flags | (m_config.block_checksum ? block_flag_checksum : 0);
+            _header.first_sequence = m_next_sequence;
+            m_next_sequence += _header.record_count;
+            _header.last_sequence =
+                m_next_sequence - (_header.record_count != 0 ? 1 : 0);
+
+            _ranges[_count++] = { &_header, sizeof(_header) };
+            m_file_offset += sizeof(_header) + _header.length;
+        }
+
+        for(size_t i = 0; i < segments.count; ++i)
+        {
+            _ranges[_count++] = { segments.ranges[i].first, segments.ranges[i].second };
+        }
+        sink.write(_ranges.data(), _count);
+    }
+
+    // Counts the samples of the block about to be written at m_file_offset and
+    // adds the block to the type index. Only record headers are read, fragmented
+    // space is not a sample.
+    size_t index_records(const uint8_t* data, const size_t& size)
+    {
+        using TypeIdentifierEnumUderlayingType =
+            std::underlying_type_t<TypeIdentifierEnum>;
+
+        TypeIdentifierEnum _type;
+        size_t             _sample_size;
+        size_t             _position = 0;
+        size_t             _samples  = 0;
+
+        // Samples of one type tend to come in runs, the map is only searched when
+        // the type changes.
+        type_index_t*      _entry      = nullptr;
+        TypeIdentifierEnum _entry_type = TypeIdentifierEnum::fragmented_space;
+
+        while(size - _position >= header_size<TypeIdentifierEnum>)
+        {
+            std::memcpy(&_type, data + _position, sizeof(_type));
+            std::memcpy(&_sample_size, data + _position + sizeof(_type),
+                        sizeof(_sample_size));
+            _position += header_size<TypeIdentifierEnum> + _sample_size;
+
+            if(_type == TypeIdentifierEnum::fragmented_space)
+            {
+                continue;
+            }
+            ++_samples;
+
+            if(!m_config.type_index)
+            {
+                continue;
+            }
+            if(_entry == nullptr || _type != _entry_type)
+            {
+                _entry = &m_type_index[static_cast<uint64_t>(
+                    static_cast<TypeIdentifierEnumUderlayingType>(_type))];
+                _entry_type = _type;
+                if(_entry->blocks.empty() || _entry->blocks.back() != m_file_offset)
+                {
+                    _entry->blocks.push_back(m_file_offset);
+                }
+            }
+            ++_entry->sample_count;
+        }
+        return _samples;
+    }
+
+    // The index is a block of its own, written after the last block of samples.
+    // The trailer at the very end of the file points back to it.
+    void write_type_index(sink_t& sink)
+    {
+        std::vector<uint8_t> _index;
+        auto                 _append = [&_index](const void* data, const size_t& size) {
+            const auto* _bytes = static_cast<const uint8_t*>(data);
+            _index.insert(_index.end(), _bytes, _bytes + size);
+        };
+
+        for(const auto& [_type, _entry] : m_type_index)
+        {
+            const type_index_entry_t _index_entry{ _type, _entry.sample_count,
+                                                   _entry.blocks.size() };
+            _append(&_index_entry, sizeof(_index_entry));
+            _append(_entry.blocks.data(), _entry.blocks.size() * sizeof(uint64_t));
+        }
+
+        index_trailer_t _trailer;
+        _trailer.index_offset = m_file_offset;
+        _append(&_trailer, sizeof(_trailer));
+
+        segments_t _segments;
+        _segments.add(_index.data(), _index.size());
+        write_block(sink, _segments, block_flag_index);
+    }
+
+    // Called only by the writer whose reservation wrapped, so the range
+    // [position, capacity) is exclusively owned by it. Only the header is
+    // written, the rest of the range keeps stale bytes which readers skip by the
+    // recorded size, unless it is short enough to be mistaken for the end of the
+    // stream. A reservation never ends closer than a header to the end of
+    // the buffer, so the header always fits.
+    void fragment_memory(const size_t& position)
+    {
+        auto*        _data     = m_buffer->data();
+        const size_t _capacity = m_buffer->size();
+        *reinterpret_cast<TypeIdentifierEnum*>(_data + position) =
+            TypeIdentifierEnum::fragmented_space;
+
+        size_t remaining_bytes = _capacity - position - header_size<TypeIdentifierEnum>;
+        *reinterpret_cast<size_t*>(_data + position + sizeof(TypeIdentifierEnum)) =
+            remaining_bytes;
+        clear_fragment_payload(_data + position + header_size<TypeIdentifierEnum>,
+                               remaining_bytes);
+    }
+
+    // Stale bytes in a fragment of the end-of-stream record's size could read as
+    // that record, so such short payloads are cleared.
+    static void clear_fragment_payload(uint8_t* payload, const size_t& size)
+    {
+        if(size <= sizeof(uint64_t))
+        {
+            std::memset(payload, 0, size);
+        }
+    }
+
+    // Data waiting to be flushed lives in [tail, head), possibly wrapped. A
+    // reservation must never reach the tail, otherwise a full buffer would look
+    // empty. Wrapped reservations must end before limit, the start of the page
+    // holding the tail when the ring is a mapped file, whose partly flushed page
+    // is still in the previous lap.
+    __attribute__((always_inline)) inline static bool has_space(const size_t& head,
+                                                                const size_t& tail,
+                                                                const size_t& limit,
+                                                                const size_t& position,
+                                                                const size_t& end)
+    {
+        if(head >= tail)
+        {
+            return position == head || end < limit;
+        }
+        return position == head && end < limit;
+    }
+
+    __attribute__((always_inline)) inline reserved_space_t reserve_memory_space(
+        const size_t& number_of_bytes)
+    {
+        if(m_segment_count != 0)
+        {
+            return reserve_segment_space(number_of_bytes);
+        }
+
+        const size_t _capacity = m_buffer->size();
+        if(__builtin_expect(is_out_of_line(number_of_bytes), 0))
+        {
+            return reserve_out_of_line();
+        }
+
+        if(m_config.overrun_policy == overrun_policy_t::grow &&
+           m_overflow_active.load(std::memory_order_acquire))
+        {
+            return { nullptr, 0, 0, true };
+        }
+
+        size_t _head = m_head.load(std::memory_order_relaxed);
+        size_t _position;
+        bool   _wrap;
+
+        while(true)
+        {
+            const size_t _tail  = m_tail.load(std::memory_order_acquire);
+            const size_t _limit = _tail & m_page_mask;
+
+            _wrap = __builtin_expect(
+                (_head + number_of_bytes + header_size<TypeIdentifierEnum>) > _capacity,
+                0);
+            _position = _wrap ? 0 : _head;
+
+            const size_t _end = _position + number_of_bytes;
+            if(__builtin_expect(!has_space(_head, _tail, _limit, _position, _end), 0))
+            {
+                if(!handle_overrun())
+                {
+                    return overrun_space();
+                }
+                _head = m_head.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            if(m_head.compare_exchange_weak(_head, _end, std::memory_order_acq_rel,
+                                            std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+
+        if(_wrap)
+        {
+            fragment_memory(_head);
+        }
+
+        return { m_buffer->data() + _position, _head, _position + number_of_bytes };
+    }
+
+    // Reservations are taken from the active segment only, the generation in its
+    // state keeps a writer holding an outdated segment number from reserving in
+    // the segment once it is reused.
+    reserved_space_t reserve_segment_space(const size_t& number_of_bytes)
+    {
+        if(__builtin_expect(is_out_of_line(number_of_bytes), 0))
+        {
+            return reserve_out_of_line();
+        }
+
+        if(m_config.overrun_policy == overrun_policy_t::grow &&
+           m_overflow_active.load(std::memory_order_acquire))
+        {
+            return { nullptr, 0, 0, true };
+        }
+
+        while(true)
+        {
+            const size_t _active  = m_active_segment.load(std::memory_order_acquire);
+            auto&        _segment = segment(_active);
+            uint64_t     _state   = _segment.state.load(std::memory_order_acquire);
+
+            // Outside its generation the segment is flushed already.
+            if(in_generation(_state, _active) && (_state & segment_sealed) == 0)
+            {
+                const size_t _offset = _state & segment_offset_mask;
+                if(_offset + number_of_bytes <= m_segment_size)
+                {
+                    if(_segment.state.compare_exchange_weak(
+                           _state, _state + number_of_bytes, std::memory_order_acq_rel,
+                           std::memory_order_relaxed))
+                    {
+                        const size_t _begin =
+                            (_active % m_segment_count) * m_segment_size + _offset;
+                        return { m_buffer->data() + _begin, _begin,
+                                 _begin + number_of_bytes };
+                    }
+                    continue;
+                }
+
+                // Full, the segment goes to the flusher as it is.
+                if(!_segment.state.compare_exchange_strong(
+                       _state, _state | segment_sealed, std::memory_order_acq_rel))
+                {
+                    continue;
+                }
+                m_worker_synchronization->request_flush();
+            }
+
+            if(!advance_segment(_active) && !handle_overrun())
+            {
+                return overrun_space();
+            }
+        }
+    }
+
+    // Records that do not fit in the buffer, or a segment of it, skip the buffer.
+    bool is_out_of_line(const size_t& number_of_bytes) const
+    {
+        const size_t _limit = m_segment_count != 0
+                                  ? m_segment_size
+                                  : m_buffer->size() - header_size<TypeIdentifierEnum>;
+        return number_of_bytes > _limit;
+    }
+
+    // Applies to single samples only, batches are never split by size.
+    bool exceeds_out_of_line_size(const size_t& number_of_bytes) const
+    {
+        return m_config.out_of_line_size != 0 &&
+               number_of_bytes >= m_config.out_of_line_size;
+    }
+
+    // The records are handed to store_out_of_line. A mapped output file is the
+    // buffer itself, so nothing can be written beside it.
+    reserved_space_t reserve_out_of_line()
+    {
+        if(m_mapped_file != nullptr)
+        {
+            throw std::runtime_error("Sample is larger than the buffered storage.");
+        }
+        return { nullptr, 0, 0, false, true };
+    }
+
+    // No space given after an overrun, only the grow policy keeps the records.
+    reserved_space_t overrun_space() const
+    {
+        return { nullptr, 0, 0, m_config.overrun_policy == overrun_policy_t::grow };
+    }
+
+    // Makes the segment after the sealed or flushed segment seq active, once it
+    // is free.
+    bool advance_segment(size_t seq)
+    {
+        const size_t _flushed = m_flushed_segments.load(std::memory_order_acquire);
+        if(seq >= _flushed)
+        {
+            const uint64_t _state = segment(seq).state.load(std::memory_order_acquire);
+            if(!in_generation(_state, seq) || (_state & segment_sealed) == 0)
+            {
+                return false;
+            }
+        }
+        if(seq + 1 >= _flushed + m_segment_count)
+        {
+            return false;
+        }
+        m_active_segment.compare_exchange_strong(seq, seq + 1, std::memory_order_acq_rel);
+        return true;
+    }
+
+    // True once the segment is sealed and all its reservations are committed.
+    bool segment_complete(const size_t& seq)
+    {
+        const auto&    _segment = segment(seq);
+        const uint64_t _state   = _segment.state.load(std::memory_order_acquire);
+        return (_state & segment_sealed) != 0 &&
+               _segment.committed.load(std::memory_order_acquire) ==
+                   (_state & segment_offset_mask);
+    }
+
+    // Prepares the flushed or dropped segment seq for its next use. Caller must
+    // hold m_mutex.
+    void release_segment(const size_t& seq)
+    {
+        auto& _segment = segment(seq);
+        _segment.committed.store(0, std::memory_order_relaxed);
+        _segment.state.store(make_segment_state(seq + m_segment_count, 0),
+                             std::memory_order_release);
+        m_flushed_segments.store(seq + 1, std::memory_order_release);
+    }
+
+    // Returns true if the reservation should be retried.
+    bool handle_overrun()
+    {
+        switch(m_config.overrun_policy)
+        {
+            case overrun_policy_t::drop_newest: return false;
+            case overrun_policy_t::grow:
+            {
+                request_flush();
+                return false;
+            }
+            case overrun_policy_t::drop_oldest:
+            {
+                if(m_segment_count != 0 ? drop_oldest_segment() : drop_oldest_samples())
+                {
+                    return true;
+                }
+                break;
+            }
+            case overrun_policy_t::block: break;
+        }
+
+        if(!is_running())
+        {
+            throw std::runtime_error(
+                "Buffered storage stopped while waiting for free space");
+        }
+
+        request_flush();
+        rewind_drained_buffer();
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        return true;
+    }
+
+    // Discards the oldest committed sample. Holding m_mutex keeps the flusher
+    // from writing the same range at the same time.
+    bool drop_oldest_samples()
+    {
+        std::unique_lock _lock{ m_mutex, std::try_to_lock };
+        if(!_lock.owns_lock())
+        {
+            return false;
+        }
+
+        const size_t _commit = m_commit.load(std::memory_order_acquire);
+        size_t       _tail   = m_tail.load(std::memory_order_relaxed);
+        if(_tail == _commit)
+        {
+            return false;
+        }
+
+        // The sample at the tail follows an out-of-line record still to be written.
+        if(m_out_of_line_pending.load(std::memory_order_acquire))
+        {
+            std::lock_guard _out_of_line_lock{ m_out_of_line_mutex };
+            if(!m_out_of_line.empty() && m_out_of_line.front().position == _tail)
+            {
+                return false;
+            }
+        }
+
+        auto* _data = m_buffer->data() + _tail;
+        auto  _type = *reinterpret_cast<TypeIdentifierEnum*>(_data);
+        auto  _size = *reinterpret_cast<size_t*>(_data + sizeof(TypeIdentifierEnum));
+
+        _tail += header_size<TypeIdentifierEnum> + _size;
+        if(_tail == m_buffer->size())
+        {
+            _tail = 0;
+        }
+        if(_type != TypeIdentifierEnum::fragmented_space)
+        {
+            m_dropped_samples.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        m_tail.store(_tail, std::memory_order_release);
+        return true;
+    }
+
+    // Discards the oldest complete segment that is not flushed yet.
+    bool drop_oldest_segment()
+    {
+        std::unique_lock _lock{ m_mutex, std::try_to_lock };
+        if(!_lock.owns_lock())
+        {
+            return false;
+        }
+
+        const size_t _oldest = m_flushed_segments.load(std::memory_order_relaxed);
+        if(_oldest > m_active_segment.load(std::memory_order_acquire) ||
+           !segment_complete(_oldest))
+        {
+            return false;
+        }
+
+        const auto* _data = segment_data(_oldest);
+        const size_t _size =
+            segment(_oldest).state.load(std::memory_order_relaxed) & segment_offset_mask;
+
+        TypeIdentifierEnum _type;
+        size_t             _sample_size;
+        for(size_t _position = 0; _position < _size;
+            _position += header_size<TypeIdentifierEnum> + _sample_size)
+        {
+            std::memcpy(&_type, _data + _position, sizeof(_type));
+            std::memcpy(&_sample_size, _data + _position + sizeof(_type),
+                        sizeof(_sample_size));
+            if(_type != TypeIdentifierEnum::fragmented_space)
+            {
+                m_dropped_samples.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        release_segment(_oldest);
+        return true;
+    }
+
+    // When everything is flushed but the sample still does not fit because the
+    // free space is split by the wrap point, restart the buffer from the
+    // beginning.
+    void rewind_drained_buffer()
+    {
+        std::unique_lock _lock{ m_mutex, std::try_to_lock };
+        if(!_lock.owns_lock() || m_segment_count != 0)
+        {
+            return;
+        }
+
+        // Queued out-of-line records hold positions in the current lap.
+        std::lock_guard _out_of_line_lock{ m_out_of_line_mutex };
+        size_t          _head = m_commit.load(std::memory_order_acquire);
+        if(_head == 0 || m_tail.load(std::memory_order_relaxed) != _head ||
+           !m_out_of_line.empty())
+        {
+            return;
+        }
+
+        if(m_mapped_file != nullptr)
+        {
+            // The file goes on where the ring stopped, so the rest of the lap is
+            // turned into fragmented space, exactly like a wrapping reservation.
+            if(m_head.compare_exchange_strong(_head, 0, std::memory_order_acq_rel))
+            {
+                fragment_memory(_head);
+                m_commit.store(0, std::memory_order_release);
+            }
+            return;
+        }
+
+        if(m_head.compare_exchange_strong(_head, 0, std::memory_order_acq_rel))
+        {
+            m_commit.store(0, std::memory_order_release);
+            m_tail.store(0, std::memory_order_release);
+        }
+    }
+
+    // Reservations are committed in the order they were made, so m_commit only
+    // ever covers fully serialized records and the flusher never reads a record
+    // that is still being written.
+    __attribute__((always_inline)) inline void commit_memory_space(
+        const reserved_space_t& space)
+    {
+        // Segments are flushed whole, so commits need no order. The last commit
+        // of a sealed segment wakes the flusher.
+        if(m_segment_count != 0)
+        {
+            auto&        _segment   = m_segments[space.begin / m_segment_size];
+            const size_t _committed = _segment.committed.fetch_add(
+                                          space.end - space.begin,
+                                          std::memory_order_acq_rel) +
+                                      space.end - space.begin;
+            const uint64_t _state = _segment.state.load(std::memory_order_acquire);
+            if(__builtin_expect((_state & segment_sealed) != 0, 0) &&
+               (_state & segment_offset_mask) == _committed)
+            {
+                m_worker_synchronization->request_flush();
+            }
+            return;
+        }
+
+        size_t _spins = 0;
+        while(m_commit.load(std::memory_order_acquire) != space.begin)
+        {
+            if(++_spins % 64 == 0)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                utility::cpu_relax();
+            }
+        }
+        m_commit.store(space.end, std::memory_order_release);
+    }
+
+    __attribute__((always_inline)) inline bool is_running() const
+    {
+        return m_worker_synchronization->is_running;
+    }
+
+    // Segment state: generation in the upper half, then the sealed bit and the
+    // reserved bytes. The generation is the segment number, which counts every
+    // use of a segment.
+    static constexpr uint64_t segment_sealed      = uint64_t{ 1 } << 31;
+    static constexpr uint64_t segment_offset_mask = segment_sealed - 1;
+
+    static constexpr uint64_t make_segment_state(const size_t& seq, const size_t& offset)
+    {
+        return (static_cast<uint64_t>(seq) << 32) | offset;
+    }
+
+    static constexpr bool in_generation(const uint64_t& state, const size_t& seq)
+    {
+        return static_cast<uint32_t>(state >> 32) == static_cast<uint32_t>(seq);
+    }
+
+    struct segment_t
+    {
+        alignas(cache_line_size) std::atomic<uint64_t> state{ 0 };
+        alignas(cache_line_size) std::atomic<size_t> committed{ 0 };
+    };
+
+    segment_t& segment(const size_t& seq) { return m_segments[seq % m_segment_count]; }
+
+    uint8_t* segment_data(const size_t& seq)
+    {
+        return m_buffer->data() + (seq % m_segment_count) * m_segment_size;
+    }
+
+private:
+    buffered_storage_config_t    m_config;
+    std::string                  m_mapped_filepath;
+    worker_synchronization_ptr_t m_worker_synchronization{
+        std::make_shared<worker_synchronization_t>()
+    };
+
+    std::shared_ptr<typename WorkerFactory::worker_t> m_worker;
+
+    alignas(cache_line_size) std::unique_ptr<buffer_memory_t> m_buffer;
+    const size_t                 m_segment_count;
+    const size_t                 m_segment_size;
+    std::unique_ptr<segment_t[]> m_segments;
+    // Numbers of the segment taking reservations and of the oldest unflushed one.
+    alignas(cache_line_size) std::atomic<size_t> m_active_segment{ 0 };
+    alignas(cache_line_size) std::atomic<size_t> m_flushed_segments{ 0 };
+
+    // Set while m_buffer is a mapped output file, which m_buffer owns.
+    mapped_file_buffer_t* m_mapped_file{ nullptr };
+    const size_t          m_page_mask{ m_mapped_filepath.empty()
+                                           ? ~size_t{ 0 }
+                                           : ~(mapped_file_buffer_t::page_size() - 1) };
+    alignas(cache_line_size) std::atomic<size_t> m_head{ 0 };
+    alignas(cache_line_size) std::atomic<size_t> m_commit{ 0 };
+    alignas(cache_line_size) std::atomic<size_t> m_tail{ 0 };
+
+    std::mutex        m_mutex;
+    std::atomic<bool> m_flush_requested{ false };
+    std::atomic<bool> m_threshold_signaled{ false };
+    std::atomic<bool> m_close_pending{ false };
+
+    struct type_index_t
+    {
+        size_t                sample_count{ 0 };
+        std::vector<uint64_t> blocks;  // file offsets of the block headers
+    };
+
+    // Framed file state, guarded by m_mutex.
+    size_t                           m_file_offset{ 0 };
+    size_t                           m_next_sequence{ 0 };
+    std::map<uint64_t, type_index_t> m_type_index;
+
+    std::mutex           m_overflow_mutex;
+    std::vector<uint8_t> m_overflow;
+    std::atomic<bool>    m_overflow_active{ false };
+
+    // Queued in stream order, see store_out_of_line. Besides a single record
+    // the queue holds no more than the buffer size, except with the grow policy.
+    std::mutex                       m_out_of_line_mutex;
+    std::deque<out_of_line_record_t> m_out_of_line;
+    size_t                           m_out_of_line_bytes{ 0 };
+    std::atomic<bool>                m_out_of_line_pending{ false };
+
+    std::atomic<size_t> m_dropped_samples{ 0 };
+    std::atomic<size_t> m_overflow_samples{ 0 };
+    std::atomic<size_t> m_out_of_line_samples{ 0 };
+
+    inline static std::atomic<size_t> s_instance_counter{ 0 };
+    const size_t                      m_id{ s_instance_counter++ };
 
-    std::mutex                      m_mutex;
-    size_t                          m_head{ 0 };
-    size_t                          m_tail{ 0 };
-    std::unique_ptr<buffer_array_t> m_buffer{ std::make_unique<buffer_array_t>() };
+    std::mutex                        m_staging_mutex;
+    std::vector<staging_buffer_ptr_t> m_staging_buffers;
 };
 
-}  // namespace trace_cache
\ No newline at end of file
+}  // namespace trace_cache
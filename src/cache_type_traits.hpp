@@ -1,4 +1,6 @@
 #pragma once
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string_view>
 #include <tuple>
@@ -125,6 +127,26 @@ check_type()
                   "Type don't have `type_identifier` member with correct type.");
 }
 
+template <typename TypeIdentifierEnum, typename... Types>
+constexpr bool
+has_unique_identifiers()
+{
+    constexpr std::array<TypeIdentifierEnum, sizeof...(Types)> _ids{
+        Types::type_identifier...
+    };
+    for(size_t i = 0; i < _ids.size(); ++i)
+    {
+        for(size_t j = i + 1; j < _ids.size(); ++j)
+        {
+            if(_ids[i] == _ids[j])
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 template <typename T, typename TypeIdentifierEnum, typename CacheableType,
           typename = void>
 struct has_execute_processing : std::false_type
@@ -139,5 +161,20 @@ struct has_execute_processing<
       std::declval<TypeIdentifierEnum>(), std::declval<const CacheableType&>()))>>
 {};
 
+template <typename T, typename Sample, typename = void>
+struct has_process : std::false_type
+{};
+
+template <typename T, typename Sample>
+struct has_process<
+    T, Sample, void_t<decltype(std::declval<T>().process(std::declval<const Sample&>()))>>
+: std::true_type
+{};
+
+// TypeProcessing handling at least one sample type with process(const Sample&).
+template <typename T, typename... Samples>
+inline constexpr bool has_any_typed_processing_v =
+    (has_process<T, Samples>::value || ...);
+
 }  // namespace type_traits
 }  // namespace trace_cache
\ No newline at end of file
@@ -17,15 +17,17 @@ struct cacheable_t
     cacheable_t() = default;
 };
 
-constexpr auto   KByte                    = 1024;
-constexpr auto   MByte                    = 1024 * 1024;
-constexpr size_t buffer_size              = 100 * MByte;
-constexpr size_t flush_threshold          = 80 * MByte;
-constexpr auto   CACHE_FILE_FLUSH_TIMEOUT = 10;  // ms
+constexpr auto   KByte           = 1024;
+constexpr auto   MByte           = 1024 * 1024;
+constexpr size_t buffer_size     = 100 * MByte;
+constexpr size_t flush_threshold = 80 * MByte;
+constexpr size_t cache_line_size = 64;
+
+// Payload of the fragmented_space record closing a stream, when enabled.
+constexpr uint64_t end_of_stream_magic = 0x4d41455254534f45;  // "EOSTREAM"
 
 template <typename TypeIdentifierEnum>
 constexpr size_t header_size = sizeof(TypeIdentifierEnum) + sizeof(size_t);
-using buffer_array_t         = std::array<uint8_t, buffer_size>;
 
 const auto tmp_directory = std::string{ "/tmp/" };
 
@@ -37,6 +39,16 @@ const auto get_buffered_storage_filename = [](const int& ppid, const int& pid) {
                         std::to_string(pid) + ".bin" };
 };
 
+__attribute__((always_inline)) inline void
+cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 template <typename Type>
 __attribute__((always_inline)) inline constexpr size_t
 get_size(Type&& val)
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "cache_type_traits.hpp"
+#include "cacheable.hpp"
+#include "type_registry.hpp"
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace trace_cache
+{
+
+// Turns buffered storage records into samples and hands them to TypeProcessing.
+// Used by storage_parser for files, and directly as buffered_storage consumer
+// when the samples are processed in the same process.
+template <typename TypeIdentifierEnum, typename TypeProcessing,
+          typename... SupportedTypes>
+class sample_decoder
+{
+    static_assert(type_traits::is_enum_class_v<TypeIdentifierEnum>,
+                  "TypeIdentifierEnum must be an enum class");
+
+public:
+    using registry_t = type_registry<TypeIdentifierEnum, SupportedTypes...>;
+    using variant_t  = typename registry_t::variant_t;
+    // Bit i stands for the i-th of SupportedTypes.
+    using type_mask_t = std::bitset<sizeof...(SupportedTypes)>;
+
+    // Typed processing receives every sample as its concrete type, without a
+    // variant and a cast back from cacheable_t. It is used when available.
+    static constexpr bool typed_processing =
+        type_traits::has_any_typed_processing_v<TypeProcessing, SupportedTypes...>;
+
+    static_assert(typed_processing ||
+                      type_traits::has_execute_processing<
+                          TypeProcessing, TypeIdentifierEnum, cacheable_t>::value,
+                  "TypeProcessing must have member function process(const T&) for "
+                  "supported types T, or member function "
+                  "execute_sample_processing(TypeIdentifierEnum, const cacheable_t&)");
+
+    explicit sample_decoder(TypeProcessing& type_processing)
+    : m_type_processing(&type_processing)
+    {}
+
+    // With typed processing, types without a process(const T&) overload are
+    // skipped without being deserialized.
+    static type_mask_t handled_types()
+    {
+        type_mask_t _mask;
+        (_mask.set(registry_t::index_of(SupportedTypes::type_identifier),
+                   !typed_processing ||
+                       type_traits::has_process<TypeProcessing, SupportedTypes>::value),
+         ...);
+        return _mask;
+    }
+
+    // Processes a stream of records. A record split across calls is kept until
+    // the rest of it arrives; only its own bytes are copied, the records after
+    // it are decoded in place. A split record that is not processed, such as
+    // fragmented space or a filtered type, is skipped without being copied.
+    // Returns false once the end-of-stream record was seen, data after it is
+    // ignored.
+    bool consume(uint8_t* data, size_t size)
+    {
+        if(m_end_of_stream)
+        {
+            return false;
+        }
+
+        size_t _offset = skip(size);
+        if(!m_pending.empty())
+        {
+            _offset += complete_pending(data + _offset, size - _offset);
+        }
+        if(m_skip != 0 || !m_pending.empty() || m_end_of_stream)
+        {
+            return !m_end_of_stream;
+        }
+
+        const size_t _consumed = consume_records(data + _offset, size - _offset);
+        if(!m_end_of_stream)
+        {
+            hold_partial(data + _offset + _consumed, size - _offset - _consumed);
+        }
+        return !m_end_of_stream;
+    }
+
+    // Bytes of an incomplete record waiting for the rest of it.
+    size_t pending_bytes() const { return m_pending.size(); }
+
+    // True while a record split across calls is not complete, kept or skipped.
+    bool incomplete() const { return !m_pending.empty() || m_skip != 0; }
+
+    bool end_of_stream() const { return m_end_of_stream; }
+
+    // Only samples of the types in the mask are processed, limited to the types
+    // TypeProcessing handles. Records of other types are skipped undecoded.
+    void set_type_mask(const type_mask_t& mask) { m_type_mask = mask & handled_types(); }
+
+    // As set_type_mask, an empty list selects every handled type.
+    void set_type_filter(const std::vector<TypeIdentifierEnum>& types)
+    {
+        type_mask_t _mask;
+        for(const auto& _type : types)
+        {
+            const size_t _index = registry_t::index_of(_type);
+            if(_index < _mask.size())
+            {
+                _mask.set(_index);
+            }
+        }
+        set_type_mask(types.empty() ? handled_types() : _mask);
+    }
+
+    const type_mask_t& type_mask() const { return m_type_mask; }
+
+    // True if some supported types are not processed.
+    bool filtered() const { return !m_type_mask.all(); }
+
+    // Unsupported types are passed on, to be reported, only while nothing is
+    // filtered.
+    bool accepts(TypeIdentifierEnum type) const
+    {
+        const size_t _index = registry_t::index_of(type);
+        return _index < m_type_mask.size() ? m_type_mask.test(_index) : !filtered();
+    }
+
+    std::optional<variant_t> decode(TypeIdentifierEnum type, uint8_t* data) const
+    {
+        return m_registry.get_type(type, data);
+    }
+
+    // Deserializes a record and hands it to TypeProcessing right away.
+    void process_record(TypeIdentifierEnum type, uint8_t* data)
+    {
+        if constexpr(typed_processing)
+        {
+            const bool _supported = m_registry.dispatch(type, data, [&](auto&& sample) {
+                using sample_t = std::decay_t<decltype(sample)>;
+                if constexpr(type_traits::has_process<TypeProcessing, sample_t>::value)
+                {
+                    m_type_processing->process(std::as_const(sample));
+                }
+            });
+            if(!_supported)
+            {
+                std::cout << "Unsupported type detected. Skipping current sample."
+                          << std::endl;
+            }
+        }
+        else
+        {
+            deliver_sample(type, m_registry.get_type(type, data));
+        }
+    }
+
+    void deliver_sample(TypeIdentifierEnum type, std::optional<variant_t> sample_value)
+    {
+        if(!sample_value.has_value())
+        {
+            std::cout << "Unsupported type detected. Skipping current sample."
+                      << std::endl;
+        }
+        else if constexpr(typed_processing)
+        {
+            std::visit(
+                [&](const auto& sample) {
+                    using sample_t      = std::decay_t<decltype(sample)>;
+                    constexpr bool _has = type_traits::has_process<TypeProcessing,
+                                                                   sample_t>::value;
+                    if constexpr(_has)
+                    {
+                        m_type_processing->process(sample);
+                    }
+                },
+                sample_value.value());
+        }
+        else
+        {
+            m_type_processing->execute_sample_processing(
+                type, std::visit(
+                          [](auto& arg) -> cacheable_t& {
+                              return static_cast<cacheable_t&>(arg);
+                          },
+                          sample_value.value()));
+        }
+    }
+
+private:
+    struct __attribute__((packed)) sample_header
+    {
+        TypeIdentifierEnum type;
+        size_t             sample_size;
+    };
+
+    // Appends the bytes missing from the pending record, processes it once it is
+    // complete and returns the number of bytes taken from data.
+    size_t complete_pending(uint8_t* data, const size_t& size)
+    {
+        size_t _taken = 0;
+        auto   _take  = [&](const size_t& record_size) {
+            const size_t _count = std::min(record_size - m_pending.size(), size - _taken);
+            m_pending.insert(m_pending.end(), data + _taken, data + _taken + _count);
+            _taken += _count;
+            return m_pending.size() == record_size;
+        };
+
+        sample_header header;
+        if(m_pending.size() < sizeof(header) && !_take(sizeof(header)))
+        {
+            return _taken;
+        }
+        std::memcpy(&header, m_pending.data(), sizeof(header));
+        if(skipped(header))
+        {
+            m_skip = header.sample_size;
+            m_pending.clear();
+            return _taken + skip(size - _taken);
+        }
+        if(!_take(sizeof(header) + header.sample_size))
+        {
+            return _taken;
+        }
+
+        consume_records(m_pending.data(), m_pending.size());
+        m_pending.clear();
+        return _taken;
+    }
+
+    // Split records the decoder would throw away are not kept, the end-of-stream
+    // record is the only fragmented space it reads.
+    bool skipped(const sample_header& header) const
+    {
+        if(header.type == TypeIdentifierEnum::fragmented_space)
+        {
+            return header.sample_size != sizeof(uint64_t);
+        }
+        return header.sample_size == 0 || !accepts(header.type);
+    }
+
+    // Drops up to size bytes of a skipped record and returns their number.
+    size_t skip(const size_t& size)
+    {
+        const size_t _count = std::min(m_skip, size);
+        m_skip -= _count;
+        return _count;
+    }
+
+    // Keeps the start of a record split across calls, or only the number of
+    // bytes left to skip once its header tells it is not processed.
+    void hold_partial(uint8_t* data, const size_t& size)
+    {
+        sample_header header;
+        if(size >= sizeof(header))
+        {
+            std::memcpy(&header, data, sizeof(header));
+            if(skipped(header))
+            {
+                m_skip = sizeof(header) + header.sample_size - size;
+                return;
+            }
+        }
+        m_pending.assign(data, data + size);
+    }
+
+    // Processes the complete records at the start of data and returns their size.
+    size_t consume_records(uint8_t* data, const size_t& size)
+    {
+        sample_header header;
+        size_t        position = 0;
+
+        while(size - position >= sizeof(header))
+        {
+            std::memcpy(&header, data + position, sizeof(header));
+            if(header.sample_size > size - position - sizeof(header))
+            {
+                break;
+            }
+
+            uint8_t* sample_data = data + position + sizeof(header);
+            position += sizeof(header) + header.sample_size;
+
+            if(header.type == TypeIdentifierEnum::fragmented_space)
+            {
+                uint64_t magic = 0;
+                if(header.sample_size == sizeof(magic))
+                {
+                    std::memcpy(&magic, sample_data, sizeof(magic));
+                }
+                if(magic == end_of_stream_magic)
+                {
+                    m_end_of_stream = true;
+                    break;
+                }
+                continue;
+            }
+
+            if(header.sample_size != 0 && accepts(header.type))
+            {
+                process_record(header.type, sample_data);
+            }
+        }
+        return position;
+    }
+
+    registry_t                      m_registry;
+    TypeProcessing*                 m_type_processing;
+    type_mask_t                     m_type_mask{ handled_types() };
+    std::vector<uint8_t>            m_pending;
+    size_t                          m_skip{ 0 };  // bytes left of a skipped record
+    bool                            m_end_of_stream{ false };
+};
+
+}  // namespace trace_cache
@@ -0,0 +1,264 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits.h>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "cacheable.hpp"
+
+namespace trace_cache
+{
+
+// Destination of flushed data. Each write() call receives one whole block, its
+// header included in a framed file, so a sink can hand it over in one system
+// call. A flush may write several blocks, always in order.
+struct sink_t
+{
+    virtual ~sink_t() = default;
+
+    virtual void write(const iovec* ranges, size_t count) = 0;
+    // Makes everything written so far visible to readers of the output.
+    virtual void flush() {}
+};
+
+// Discards the data, used when a consumer receives it instead of a file.
+struct null_sink_t : public sink_t
+{
+    void write(const iovec*, size_t) override {}
+};
+
+// Writes to any std::ostream, e.g. a std::ostringstream.
+class ostream_sink_t : public sink_t
+{
+public:
+    explicit ostream_sink_t(std::ostream& os)
+    : m_os(os)
+    {}
+
+    void write(const iovec* ranges, size_t count) override
+    {
+        for(size_t i = 0; i < count; ++i)
+        {
+            m_os.write(static_cast<const char*>(ranges[i].iov_base), ranges[i].iov_len);
+        }
+    }
+
+    void flush() override { m_os.flush(); }
+
+private:
+    std::ostream& m_os;
+};
+
+// Writes through a std::ofstream and its own buffering.
+class ofstream_sink_t : public ostream_sink_t
+{
+public:
+    explicit ofstream_sink_t(const std::string& filepath)
+    : ostream_sink_t(m_ofs)
+    , m_ofs{ filepath, std::ios::binary | std::ios::out }
+    {
+        if(!m_ofs.good())
+        {
+            std::stringstream _ss;
+            _ss << "Error opening file for writing: " << filepath;
+            throw std::runtime_error(_ss.str());
+        }
+    }
+
+private:
+    std::ofstream m_ofs;
+};
+
+// Unbuffered writes straight to the file descriptor. A flush is written with a
+// single pwritev call, unless the kernel accepts only part of it.
+class file_sink_t : public sink_t
+{
+public:
+    explicit file_sink_t(const std::string& filepath)
+    : file_sink_t(filepath, 0)
+    {}
+
+    ~file_sink_t() override { close(m_fd); }
+
+    file_sink_t(const file_sink_t&)            = delete;
+    file_sink_t& operator=(const file_sink_t&) = delete;
+
+    void write(const iovec* ranges, size_t count) override
+    {
+        // write_ranges consumes the ranges, they are copied to a reused vector.
+        m_ranges.assign(ranges, ranges + count);
+        write_ranges(m_ranges.data(), m_ranges.size());
+    }
+
+protected:
+    file_sink_t(const std::string& filepath, int flags)
+    {
+        m_fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | flags,
+                    0644);
+        if(m_fd == -1 && errno == EINVAL && (flags & O_DIRECT) != 0)
+        {
+            std::cout << "O_DIRECT is not supported for " << filepath
+                      << ", writing through the page cache." << std::endl;
+            m_fd = open(filepath.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (flags & ~O_DIRECT),
+                        0644);
+        }
+        if(m_fd == -1)
+        {
+            std::stringstream _ss;
+            _ss << "Error opening file for writing: " << filepath << " ("
+                << strerror(errno) << ")";
+            throw std::runtime_error(_ss.str());
+        }
+    }
+
+    // Writes the ranges at the current offset, the ranges are consumed.
+    void write_ranges(iovec* ranges, size_t count)
+    {
+        while(count != 0)
+        {
+            const int     _batch = static_cast<int>(std::min<size_t>(count, IOV_MAX));
+            const ssize_t _written = pwritev(m_fd, ranges, _batch, m_offset);
+            if(_written < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                // The flushing thread has no caller to report to, the data is lost.
+                std::cout << "Error writing buffered storage: " << strerror(errno)
+                          << std::endl;
+                return;
+            }
+
+            m_offset += _written;
+            for(size_t _left = static_cast<size_t>(_written); _left != 0;)
+            {
+                const size_t _size = std::min(_left, ranges->iov_len);
+                ranges->iov_base   = static_cast<uint8_t*>(ranges->iov_base) + _size;
+                ranges->iov_len -= _size;
+                _left -= _size;
+                if(ranges->iov_len == 0)
+                {
+                    ++ranges;
+                    --count;
+                }
+            }
+            while(count != 0 && ranges->iov_len == 0)
+            {
+                ++ranges;
+                --count;
+            }
+        }
+    }
+
+    int                m_fd{ -1 };
+    off_t              m_offset{ 0 };
+    std::vector<iovec> m_ranges;
+};
+
+// Writes with O_DIRECT, bypassing the page cache. Data is collected in an
+// aligned staging buffer, so writes start and end on block boundaries. On a
+// flush the last partial block is written zero padded and the file truncated
+// to its real size; the block is written again once more data arrives, so the
+// file should not be followed while it is written. A flush without new data
+// writes nothing. File systems without
+// O_DIRECT support (e.g. tmpfs) get regular writes.
+class direct_file_sink_t : public file_sink_t
+{
+public:
+    static constexpr size_t alignment    = 4 * KByte;
+    static constexpr size_t staging_size = 8 * MByte;
+
+    explicit direct_file_sink_t(const std::string& filepath)
+    : file_sink_t(filepath, O_DIRECT)
+    {
+        m_staging = static_cast<uint8_t*>(std::aligned_alloc(alignment, staging_size));
+        if(m_staging == nullptr)
+        {
+            throw std::runtime_error("Unable to allocate O_DIRECT staging buffer.");
+        }
+    }
+
+    ~direct_file_sink_t() override
+    {
+        flush();
+        std::free(m_staging);
+    }
+
+    void write(const iovec* ranges, size_t count) override
+    {
+        for(size_t i = 0; i < count; ++i)
+        {
+            const auto* _data = static_cast<const uint8_t*>(ranges[i].iov_base);
+            size_t      _size = ranges[i].iov_len;
+            while(_size != 0)
+            {
+                const size_t _copied = std::min(_size, staging_size - m_staged);
+                std::memcpy(m_staging + m_staged, _data, _copied);
+                m_staged += _copied;
+                _data += _copied;
+                _size -= _copied;
+
+                if(m_staged == staging_size)
+                {
+                    write_staged(staging_size);
+                    m_staged  = 0;
+                    m_written = 0;
+                }
+            }
+        }
+    }
+
+    void flush() override
+    {
+        if(m_staged == m_written)
+        {
+            return;
+        }
+
+        const size_t _padded = (m_staged + alignment - 1) / alignment * alignment;
+        std::memset(m_staging + m_staged, 0, _padded - m_staged);
+        const off_t _offset = m_offset;
+        write_staged(_padded);
+        if(_padded != m_staged &&
+           ftruncate(m_fd, _offset + static_cast<off_t>(m_staged)) != 0)
+        {
+            std::cout << "Error truncating buffered storage: " << strerror(errno)
+                      << std::endl;
+        }
+
+        // Whole blocks are done, the partial one stays staged.
+        const size_t _done = m_staged / alignment * alignment;
+        std::memmove(m_staging, m_staging + _done, m_staged - _done);
+        m_staged -= _done;
+        m_written = m_staged;
+        m_offset  = _offset + static_cast<off_t>(_done);
+    }
+
+private:
+    void write_staged(const size_t& size)
+    {
+        iovec _range{ m_staging, size };
+        write_ranges(&_range, 1);
+    }
+
+    uint8_t* m_staging{ nullptr };
+    size_t   m_staged{ 0 };
+    // Staged bytes already in the file, written by the last flush.
+    size_t   m_written{ 0 };
+};
+
+}  // namespace trace_cache
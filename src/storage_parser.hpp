@@ -1,41 +1,325 @@
 #pragma once
 
+#include "block_format.hpp"
 #include "cache_type_traits.hpp"
 #include "cacheable.hpp"
-#include "type_registry.hpp"
+#include "sample_decoder.hpp"
+#include <algorithm>
+#include <atomic>
 #include <bits/chrono.h>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdint.h>
 #include <string.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
 #include <vector>
 
 namespace trace_cache
 {
 
+enum class parser_read_mode_t
+{
+    stream,         // buffered reads of every record into a reused buffer
+    mmap,           // file mapped read-only, samples deserialized in place
+    mmap_populate,  // as mmap, with the whole file prefaulted (MAP_POPULATE)
+    follow,         // reads records as they are flushed, until end-of-stream
+    read_ahead      // an I/O thread reads ahead into large buffers while decoding
+};
+
+enum class parser_delivery_t
+{
+    ordered,   // samples reach TypeProcessing in file order, from the loading thread
+    unordered  // samples reach TypeProcessing concurrently from the parsing threads
+};
+
+struct storage_parser_config_t
+{
+    parser_read_mode_t read_mode{ parser_read_mode_t::mmap };
+    // Threads deserializing the file. Values above 1 need a mmap read mode and
+    // split the file into chunks of about chunk_size bytes at record boundaries.
+    // Blocks of framed files are never merged into one chunk.
+    size_t             threads{ 1 };
+    size_t             chunk_size{ 4 * MByte };
+    parser_delivery_t  delivery{ parser_delivery_t::ordered };
+    // Follow mode waits this long between polls for new data. It stops at the
+    // end-of-stream record, or once no data arrived for follow_idle_timeout
+    // (zero waits indefinitely).
+    std::chrono::milliseconds follow_poll_interval{ 10 };
+    std::chrono::milliseconds follow_idle_timeout{ 0 };
+    // Read-ahead mode reads read_ahead_size bytes at a time into a ring of
+    // read_ahead_buffers buffers. Buffers that fit the CPU caches decode fastest
+    // from local disks, slow or network disks gain from larger ones.
+    size_t read_ahead_size{ 1 * MByte };
+    size_t read_ahead_buffers{ 4 };
+};
+
+// Private copy-on-write mapping of a whole file. Pages are only copied if a
+// deserializer writes through its data pointer, the file itself never changes.
+class mapped_file_t
+{
+public:
+    mapped_file_t(const std::string& filename, bool populate)
+    {
+        const int _fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if(_fd == -1)
+        {
+            std::stringstream ss;
+            ss << "Error opening file for reading: " << filename << "\n";
+            throw std::runtime_error(ss.str());
+        }
+
+        struct stat _stat;
+        if(fstat(_fd, &_stat) != 0)
+        {
+            close(_fd);
+            std::stringstream ss;
+            ss << "Unable to get size of file: " << filename << " (" << strerror(errno)
+               << ")\n";
+            throw std::runtime_error(ss.str());
+        }
+
+        m_size = static_cast<size_t>(_stat.st_size);
+        if(m_size == 0)
+        {
+            close(_fd);
+            return;
+        }
+
+        const int _flags = MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+        void*     _data  = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, _flags, _fd, 0);
+        close(_fd);
+
+        if(_data == MAP_FAILED)
+        {
+            std::stringstream ss;
+            ss << "Unable to map file: " << filename << " (" << strerror(errno) << ")\n";
+            throw std::runtime_error(ss.str());
+        }
+
+        m_data = static_cast<uint8_t*>(_data);
+        madvise(m_data, m_size, MADV_SEQUENTIAL);
+    }
+
+    ~mapped_file_t()
+    {
+        if(m_data != nullptr)
+        {
+            munmap(m_data, m_size);
+        }
+    }
+
+    mapped_file_t(const mapped_file_t&)            = delete;
+    mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+    uint8_t* data() const { return m_data; }
+    size_t   size() const { return m_size; }
+
+private:
+    uint8_t* m_data{ nullptr };
+    size_t   m_size{ 0 };
+};
+
+// Reads a file front to back on an I/O thread, into a ring of page aligned
+// buffers, while the consuming thread works on the buffers already filled.
+class read_ahead_file_t
+{
+public:
+    struct buffer_t
+    {
+        uint8_t* data;
+        size_t   size;
+    };
+
+    read_ahead_file_t(const std::string& filename, size_t buffer_size,
+                      size_t buffer_count)
+    : m_buffer_size(buffer_size)
+    , m_stride(align_up(buffer_size))
+    , m_sizes(buffer_count)
+    {
+        if(buffer_size == 0 || buffer_count == 0)
+        {
+            throw std::runtime_error("Read-ahead needs at least one non-empty buffer.");
+        }
+
+        m_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if(m_fd == -1)
+        {
+            std::stringstream ss;
+            ss << "Error opening file for reading: " << filename << "\n";
+            throw std::runtime_error(ss.str());
+        }
+        posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        m_memory = static_cast<uint8_t*>(
+            std::aligned_alloc(page_size, m_stride * buffer_count));
+        if(m_memory == nullptr)
+        {
+            close(m_fd);
+            throw std::runtime_error("Unable to allocate read-ahead buffers.");
+        }
+
+        m_reader = std::thread([this]() { read_loop(); });
+    }
+
+    ~read_ahead_file_t()
+    {
+        {
+            std::lock_guard _lock{ m_mutex };
+            m_stopped = true;
+        }
+        m_condition.notify_all();
+        m_reader.join();
+
+        std::free(m_memory);
+        close(m_fd);
+    }
+
+    read_ahead_file_t(const read_ahead_file_t&)            = delete;
+    read_ahead_file_t& operator=(const read_ahead_file_t&) = delete;
+
+    // Waits for the next filled buffer, an empty one marks the end of the file.
+    // The buffer stays valid until release().
+    buffer_t next()
+    {
+        std::unique_lock _lock{ m_mutex };
+        m_condition.wait(_lock, [&]() { return m_filled != 0 || m_finished; });
+
+        if(m_filled == 0)
+        {
+            if(!m_error.empty())
+            {
+                throw std::runtime_error(m_error);
+            }
+            return { nullptr, 0 };
+        }
+
+        const size_t _slot = m_consumed % m_sizes.size();
+        return { m_memory + _slot * m_stride, m_sizes[_slot] };
+    }
+
+    void release()
+    {
+        {
+            std::lock_guard _lock{ m_mutex };
+            --m_filled;
+            ++m_consumed;
+        }
+        m_condition.notify_all();
+    }
+
+private:
+    static constexpr size_t page_size = 4 * KByte;
+
+    static size_t align_up(const size_t& size)
+    {
+        return (size + page_size - 1) / page_size * page_size;
+    }
+
+    void read_loop()
+    {
+        std::string _error;
+        for(size_t _slot_index = 0;; ++_slot_index)
+        {
+            {
+                std::unique_lock _lock{ m_mutex };
+                m_condition.wait(
+                    _lock, [&]() { return m_stopped || m_filled < m_sizes.size(); });
+                if(m_stopped)
+                {
+                    break;
+                }
+            }
+
+            // The slot is not visible to the consumer until it is counted as filled.
+            const size_t _slot = _slot_index % m_sizes.size();
+            uint8_t*     _data = m_memory + _slot * m_stride;
+            size_t       _size = 0;
+            while(_size < m_buffer_size)
+            {
+                const ssize_t _bytes_read =
+                    read(m_fd, _data + _size, m_buffer_size - _size);
+                if(_bytes_read > 0)
+                {
+                    _size += static_cast<size_t>(_bytes_read);
+                }
+                else if(_bytes_read == 0 || errno != EINTR)
+                {
+                    if(_bytes_read < 0)
+                    {
+                        _error = std::string{ "Error reading file: " } + strerror(errno);
+                    }
+                    break;
+                }
+            }
+
+            std::lock_guard _lock{ m_mutex };
+            if(_size != 0)
+            {
+                m_sizes[_slot] = _size;
+                ++m_filled;
+            }
+            if(_size < m_buffer_size)
+            {
+                m_error = _error;
+                break;
+            }
+            m_condition.notify_all();
+        }
+
+        {
+            std::lock_guard _lock{ m_mutex };
+            m_finished = true;
+        }
+        m_condition.notify_all();
+    }
+
+    int                     m_fd{ -1 };
+    size_t                  m_buffer_size;
+    size_t                  m_stride;  // every buffer starts on a page boundary
+    uint8_t*                m_memory{ nullptr };
+    std::vector<size_t>     m_sizes;  // bytes read into every buffer
+    size_t                  m_filled{ 0 };
+    size_t                  m_consumed{ 0 };
+    bool                    m_finished{ false };
+    bool                    m_stopped{ false };
+    std::string             m_error;
+    std::mutex              m_mutex;
+    std::condition_variable m_condition;
+    std::thread             m_reader;
+};
+
 template <typename TypeIdentifierEnum, typename TypeProcessing,
           typename... SupportedTypes>
 class storage_parser
 {
-    static_assert(type_traits::is_enum_class_v<TypeIdentifierEnum>,
-                  "TypeIdentifierEnum must be an enum class");
-
-    static_assert(type_traits::has_execute_processing<TypeProcessing, TypeIdentifierEnum,
-                                                      cacheable_t>::value,
-                  "TypeProcessing must have member function "
-                  "execute_sample_processing(TypeIdentifierEnum, const cacheable_t&)");
+    using decoder_t =
+        sample_decoder<TypeIdentifierEnum, TypeProcessing, SupportedTypes...>;
 
 public:
-    storage_parser(std::string _filename, std::unique_ptr<TypeProcessing> _type_processing)
+    storage_parser(std::string                     _filename,
+                   std::unique_ptr<TypeProcessing> _type_processing,
+                   storage_parser_config_t         _config = {})
     : m_filename(std::move(_filename))
     , m_type_processing(std::move(_type_processing))
+    , m_config(_config)
     {}
 
     void register_on_finished_callback(std::unique_ptr<std::function<void()>> callback)
@@ -43,11 +327,63 @@ public:
         m_on_finished_callback = std::move(callback);
     }
 
+    using type_mask_t = typename decoder_t::type_mask_t;
+
+    // Only samples of the given types reach TypeProcessing, records of other types
+    // are skipped without being read or deserialized. Files written with a type
+    // index are then read only where those types are stored. By default the
+    // types TypeProcessing has a process(const T&) overload for are selected.
+    void set_type_filter(const std::vector<TypeIdentifierEnum>& types)
+    {
+        m_decoder.set_type_filter(types);
+    }
+
+    // Bit i selects the i-th of SupportedTypes, see set_type_filter.
+    void set_type_mask(const type_mask_t& mask) { m_decoder.set_type_mask(mask); }
+
+    // Samples handed to TypeProcessing, and views they hold into the file data,
+    // are only valid during the execute_sample_processing call.
     void load()
     {
         std::cout << "Consuming buffered storage with filename: " << m_filename
                   << std::endl;
 
+        if(m_config.read_mode == parser_read_mode_t::stream)
+        {
+            load_stream();
+        }
+        else if(m_config.read_mode == parser_read_mode_t::follow)
+        {
+            load_follow();
+        }
+        else if(m_config.read_mode == parser_read_mode_t::read_ahead)
+        {
+            load_read_ahead();
+        }
+        else
+        {
+            load_mapped(m_config.read_mode == parser_read_mode_t::mmap_populate);
+        }
+
+        std::cout << "File parsing finished. Removing " << m_filename
+                  << " from file system." << std::endl;
+        std::remove(m_filename.c_str());
+
+        if(m_on_finished_callback != nullptr)
+        {
+            (*m_on_finished_callback)();
+        }
+    }
+
+private:
+    struct __attribute__((packed)) sample_header
+    {
+        TypeIdentifierEnum type;
+        size_t             sample_size;
+    };
+
+    void load_stream()
+    {
         std::ifstream ifs(m_filename, std::ios::binary);
         if(!ifs)
         {
@@ -56,11 +392,18 @@ public:
             throw std::runtime_error(ss.str());
         }
 
-        struct __attribute__((packed)) sample_header
+        uint64_t magic = 0;
+        ifs.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        const bool framed = utility::is_framed(reinterpret_cast<const uint8_t*>(&magic),
+                                               static_cast<size_t>(ifs.gcount()));
+        ifs.clear();
+        ifs.seekg(0);
+
+        if(framed)
         {
-            TypeIdentifierEnum type;
-            size_t             sample_size;
-        };
+            load_stream_blocks(ifs);
+            return;
+        }
 
         sample_header header;
 
@@ -77,6 +420,13 @@ public:
                 continue;
             }
 
+            if(header.type == TypeIdentifierEnum::fragmented_space ||
+               !m_decoder.accepts(header.type))
+            {
+                ifs.seekg(static_cast<std::streamoff>(header.sample_size), std::ios::cur);
+                continue;
+            }
+
             if(__builtin_expect(header.sample_size > last_capacity, 0))
             {
                 sample.reserve(header.sample_size);
@@ -95,47 +445,751 @@ public:
                 continue;
             }
 
-            if(header.type == TypeIdentifierEnum::fragmented_space)
+            m_decoder.process_record(header.type, sample.data());
+        }
+
+        ifs.close();
+    }
+
+    // Reads a whole block at a time, the records are then walked in memory. With
+    // a type filter and an index only the blocks listed in the index are read.
+    void load_stream_blocks(std::ifstream& ifs)
+    {
+        block_header_t       header;
+        std::vector<uint8_t> records;
+
+        std::optional<std::vector<uint64_t>> blocks;
+        if(m_decoder.filtered())
+        {
+            blocks = read_indexed_blocks(ifs);
+        }
+
+        size_t next_block  = 0;
+        auto   _next_block = [&]() {
+            if(!blocks.has_value())
+            {
+                return true;
+            }
+            if(next_block == blocks->size())
+            {
+                return false;
+            }
+            ifs.seekg((*blocks)[next_block++]);
+            return true;
+        };
+
+        while(_next_block() && ifs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        {
+            if(header.magic != block_magic)
+            {
+                report_bad_block(static_cast<size_t>(ifs.tellg()) - sizeof(header));
+                break;
+            }
+
+            if((header.flags & block_flag_index) != 0)
+            {
+                ifs.seekg(static_cast<std::streamoff>(header.length), std::ios::cur);
+                continue;
+            }
+
+            records.resize(header.length);
+            ifs.read(reinterpret_cast<char*>(records.data()), header.length);
+            if(ifs.fail())
+            {
+                std::cout << "Bad read while consuming buffered storage. Filename: "
+                          << m_filename << " Truncated block starting with sample "
+                          << header.first_sequence << std::endl;
+                break;
+            }
+
+            if(!verify_block(header, records.data()))
             {
                 continue;
             }
 
-            auto data = sample.data();
+            for_each_record(records.data(), { 0, records.size() },
+                            [&](TypeIdentifierEnum type, uint8_t* data) {
+                                m_decoder.process_record(type, data);
+                            });
+        }
+    }
+
+    // Reads the index through the trailer at the end of the file, and leaves the
+    // stream at the start of the file.
+    std::optional<std::vector<uint64_t>> read_indexed_blocks(std::ifstream& ifs) const
+    {
+        std::optional<std::vector<uint64_t>> blocks;
+        index_trailer_t                      trailer;
+        block_header_t                       header;
 
-            auto sample_value = m_registry.get_type(header.type, data);
-            if(sample_value.has_value())
+        ifs.seekg(0, std::ios::end);
+        const auto size = static_cast<size_t>(ifs.tellg());
+
+        if(size >= sizeof(trailer) + sizeof(header))
+        {
+            ifs.seekg(size - sizeof(trailer));
+            ifs.read(reinterpret_cast<char*>(&trailer), sizeof(trailer));
+        }
+
+        if(ifs && trailer.magic == index_magic &&
+           trailer.index_offset <= size - sizeof(trailer) - sizeof(header))
+        {
+            ifs.seekg(trailer.index_offset);
+            ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+            if(ifs && header.length <= size - trailer.index_offset - sizeof(header))
             {
-                m_type_processing->execute_sample_processing(
-                    header.type, std::visit(
-                                     [](auto& arg) -> cacheable_t& {
-                                         return static_cast<cacheable_t&>(arg);
-                                     },
-                                     sample_value.value()));
+                std::vector<uint8_t> records(header.length);
+                ifs.read(reinterpret_cast<char*>(records.data()), header.length);
+                if(ifs)
+                {
+                    blocks = parse_type_index(header, records.data());
+                }
             }
-            else
+        }
+
+        ifs.clear();
+        ifs.seekg(0);
+        return blocks;
+    }
+
+    // Offsets of the blocks holding samples of the accepted types, in file order.
+    // Empty if the block is not an intact type index.
+    std::optional<std::vector<uint64_t>> parse_type_index(const block_header_t& header,
+                                                          const uint8_t* records) const
+    {
+        using TypeIdentifierEnumUderlayingType =
+            std::underlying_type_t<TypeIdentifierEnum>;
+
+        if(header.magic != block_magic || (header.flags & block_flag_index) == 0 ||
+           header.length < sizeof(index_trailer_t) || !verify_block(header, records))
+        {
+            return std::nullopt;
+        }
+
+        std::vector<uint64_t> blocks;
+        type_index_entry_t    entry;
+        const size_t          end      = header.length - sizeof(index_trailer_t);
+        size_t                position = 0;
+
+        while(end - position >= sizeof(entry))
+        {
+            std::memcpy(&entry, records + position, sizeof(entry));
+            position += sizeof(entry);
+            if(entry.block_count > (end - position) / sizeof(uint64_t))
             {
-                std::cout << "Unsupported type detected. Skipping current sample."
-                          << std::endl;
+                return std::nullopt;
+            }
+
+            const auto type = static_cast<TypeIdentifierEnum>(
+                static_cast<TypeIdentifierEnumUderlayingType>(entry.type));
+            if(m_decoder.accepts(type))
+            {
+                const size_t count = blocks.size();
+                blocks.resize(count + entry.block_count);
+                std::memcpy(blocks.data() + count, records + position,
+                            entry.block_count * sizeof(uint64_t));
+            }
+            position += entry.block_count * sizeof(uint64_t);
+        }
+
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+        return blocks;
+    }
+
+    void report_bad_block(const size_t& position) const
+    {
+        std::cout << "Bad block header while consuming buffered storage. Filename: "
+                  << m_filename << " Offset: " << position << std::endl;
+    }
+
+    // A block failing its checksum is skipped, the blocks after it are still read.
+    bool verify_block(const block_header_t& header, const uint8_t* records) const
+    {
+        if((header.flags & block_flag_checksum) == 0 ||
+           utility::crc32c(records, header.length) == header.checksum)
+        {
+            return true;
+        }
+
+        std::cout << "Block checksum mismatch while consuming buffered storage. "
+                     "Filename: "
+                  << m_filename << " Skipped samples " << header.first_sequence
+                  << " to " << header.last_sequence << std::endl;
+        return false;
+    }
+
+    // Reads the file while buffered_storage is still writing it. Complete records
+    // are processed as soon as they are read, a partial record at the end of the
+    // data read so far is kept until the rest of it arrives.
+    void load_follow()
+    {
+        using clock_t = std::chrono::steady_clock;
+
+        auto last_data = clock_t::now();
+        auto timed_out = [&]() {
+            return m_config.follow_idle_timeout.count() != 0 &&
+                   clock_t::now() - last_data >= m_config.follow_idle_timeout;
+        };
+
+        // The writer may not have created the file yet.
+        std::ifstream ifs(m_filename, std::ios::binary);
+        while(!ifs.is_open())
+        {
+            if(timed_out())
+            {
+                std::stringstream ss;
+                ss << "Error opening file for reading: " << m_filename << "\n";
+                throw std::runtime_error(ss.str());
+            }
+            std::this_thread::sleep_for(m_config.follow_poll_interval);
+            ifs.open(m_filename, std::ios::binary);
+        }
+
+        constexpr size_t read_size = 1 * MByte;
+
+        decoder_t            decoder(*m_type_processing);
+        std::vector<uint8_t> chunk(read_size);
+        decoder.set_type_mask(m_decoder.type_mask());
+
+        // Returns what the writer flushed so far, waiting while there is nothing
+        // new. Zero is only returned once follow_idle_timeout passed.
+        auto _read = [&](uint8_t* data, const size_t& size) -> size_t {
+            while(true)
+            {
+                ifs.read(reinterpret_cast<char*>(data), size);
+                const auto bytes_read = static_cast<size_t>(ifs.gcount());
+                ifs.clear();
+
+                if(bytes_read != 0)
+                {
+                    last_data = clock_t::now();
+                    return bytes_read;
+                }
+                if(timed_out())
+                {
+                    std::cout << "No new data while following buffered storage. "
+                                 "Filename: "
+                              << m_filename << std::endl;
+                    return 0;
+                }
+                std::this_thread::sleep_for(m_config.follow_poll_interval);
+            }
+        };
+
+        auto _read_exactly = [&](uint8_t* data, const size_t& size) {
+            for(size_t done = 0; done < size;)
+            {
+                const size_t bytes_read = _read(data + done, size - done);
+                if(bytes_read == 0)
+                {
+                    return false;
+                }
+                done += bytes_read;
+            }
+            return true;
+        };
+
+        if(!_read_exactly(chunk.data(), sizeof(block_magic)))
+        {
+            return;
+        }
+        const bool framed = utility::is_framed(chunk.data(), sizeof(block_magic));
+        ifs.seekg(0);
+
+        // Blocks are only handed to the decoder once complete and verified.
+        block_header_t header;
+        while(!decoder.end_of_stream())
+        {
+            if(!framed)
+            {
+                const size_t bytes_read = _read(chunk.data(), read_size);
+                if(bytes_read == 0)
+                {
+                    break;
+                }
+                decoder.consume(chunk.data(), bytes_read);
                 continue;
             }
+
+            if(!_read_exactly(reinterpret_cast<uint8_t*>(&header), sizeof(header)))
+            {
+                break;
+            }
+            if(header.magic != block_magic)
+            {
+                report_bad_block(static_cast<size_t>(ifs.tellg()) - sizeof(header));
+                break;
+            }
+
+            chunk.resize(std::max(chunk.size(), header.length));
+            if(!_read_exactly(chunk.data(), header.length))
+            {
+                break;
+            }
+            if((header.flags & block_flag_index) == 0 &&
+               verify_block(header, chunk.data()))
+            {
+                decoder.consume(chunk.data(), header.length);
+            }
         }
+    }
 
-        ifs.close();
-        std::cout << "File parsing finished. Removing " << m_filename
-                  << " from file system." << std::endl;
-        std::remove(m_filename.c_str());
+    // Decodes the buffers of the read-ahead thread in place. Blocks of a framed
+    // file are handed to the decoder as they arrive, only a block with a
+    // checksum that spans buffers is collected first, to be verified.
+    void load_read_ahead()
+    {
+        read_ahead_file_t file(m_filename, m_config.read_ahead_size,
+                               m_config.read_ahead_buffers);
 
-        if(m_on_finished_callback != nullptr)
+        decoder_t decoder(*m_type_processing);
+        decoder.set_type_mask(m_decoder.type_mask());
+
+        std::optional<bool>  framed;
+        block_header_t       header;
+        size_t               header_bytes = 0;
+        size_t               block_left   = 0;
+        std::vector<uint8_t> block;
+        size_t               offset = 0;
+
+        for(auto buffer = file.next(); buffer.size != 0 && !decoder.end_of_stream();
+            file.release(), buffer = file.next())
         {
-            (*m_on_finished_callback)();
+            if(!framed.has_value())
+            {
+                framed = utility::is_framed(buffer.data, buffer.size);
+            }
+            if(!*framed)
+            {
+                decoder.consume(buffer.data, buffer.size);
+                continue;
+            }
+
+            for(size_t position = 0; position < buffer.size && !decoder.end_of_stream();)
+            {
+                if(header_bytes < sizeof(header))
+                {
+                    const size_t _size =
+                        std::min(sizeof(header) - header_bytes, buffer.size - position);
+                    std::memcpy(reinterpret_cast<uint8_t*>(&header) + header_bytes,
+                                buffer.data + position, _size);
+                    header_bytes += _size;
+                    position += _size;
+
+                    if(header_bytes < sizeof(header))
+                    {
+                        continue;
+                    }
+                    if(header.magic != block_magic)
+                    {
+                        report_bad_block(offset + position - sizeof(header));
+                        return;
+                    }
+                    block_left = header.length;
+                    continue;
+                }
+
+                const size_t _size   = std::min(block_left, buffer.size - position);
+                uint8_t*     _data   = buffer.data + position;
+                const bool   _whole  = _size == header.length;
+                const bool   _verify = (header.flags & block_flag_checksum) != 0;
+                position += _size;
+                block_left -= _size;
+
+                if((header.flags & block_flag_index) != 0)
+                {
+                    // The type index holds no records.
+                }
+                else if(!_verify)
+                {
+                    decoder.consume(_data, _size);
+                }
+                else if(_whole)
+                {
+                    if(verify_block(header, _data))
+                    {
+                        decoder.consume(_data, _size);
+                    }
+                }
+                else
+                {
+                    block.insert(block.end(), _data, _data + _size);
+                    if(block_left == 0 && verify_block(header, block.data()))
+                    {
+                        decoder.consume(block.data(), block.size());
+                    }
+                }
+
+                if(block_left == 0)
+                {
+                    header_bytes = 0;
+                    block.clear();
+                }
+            }
+            offset += buffer.size;
+        }
+
+        if(!decoder.end_of_stream() &&
+           (decoder.incomplete() || header_bytes != 0))
+        {
+            std::cout << "Bad read while consuming buffered storage. Filename: "
+                      << m_filename << " Truncated record or block at end of file."
+                      << std::endl;
         }
     }
 
-private:
+    using parsed_sample_t =
+        std::pair<TypeIdentifierEnum, std::optional<typename decoder_t::variant_t>>;
+
+    struct chunk_t
+    {
+        size_t begin;
+        size_t end;
+    };
+
+    void load_mapped(bool populate)
+    {
+        mapped_file_t file(m_filename, populate);
+
+        const auto ranges = find_record_ranges(file.data(), file.size());
+        if(m_config.threads <= 1)
+        {
+            for(const auto& range : ranges)
+            {
+                for_each_record(file.data(), range,
+                                [&](TypeIdentifierEnum type, uint8_t* data) {
+                                    m_decoder.process_record(type, data);
+                                });
+            }
+            return;
+        }
+
+        std::vector<chunk_t> chunks;
+        for(const auto& range : ranges)
+        {
+            split_into_chunks(file.data(), range, chunks);
+        }
+        if(m_config.delivery == parser_delivery_t::unordered)
+        {
+            load_unordered(file.data(), chunks);
+        }
+        else
+        {
+            load_ordered(file.data(), chunks);
+        }
+    }
+
+    // Walks the records of a chunk directly in the mapping, without copying them.
+    template <typename Callback>
+    void for_each_record(uint8_t* data, const chunk_t& chunk, Callback&& callback)
+    {
+        sample_header header;
+        size_t        position = chunk.begin;
+
+        while(chunk.end - position >= sizeof(header))
+        {
+            std::memcpy(&header, data + position, sizeof(header));
+            position += sizeof(header);
+
+            if(header.sample_size == 0)
+            {
+                continue;
+            }
+
+            if(header.sample_size > chunk.end - position)
+            {
+                std::cout << "Bad read while consuming buffered storage. Filename: "
+                          << m_filename << " Bytes read: " << chunk.end << std::endl;
+                break;
+            }
+
+            uint8_t* sample_data = data + position;
+            position += header.sample_size;
+
+            if(header.type == TypeIdentifierEnum::fragmented_space ||
+               !m_decoder.accepts(header.type))
+            {
+                continue;
+            }
+
+            callback(header.type, sample_data);
+        }
+    }
+
+    // The parts of the file holding records: all of a raw file, or the records of
+    // every intact block of a framed file. Blocks are found by hopping from header
+    // to header, or through the type index when filtering, their records are not
+    // read.
+    std::vector<chunk_t> find_record_ranges(const uint8_t* data, const size_t& size) const
+    {
+        if(!utility::is_framed(data, size))
+        {
+            return { { 0, size } };
+        }
+
+        std::vector<chunk_t> ranges;
+        if(m_decoder.filtered())
+        {
+            if(auto blocks = find_indexed_blocks(data, size))
+            {
+                for(const auto& block : *blocks)
+                {
+                    add_block_range(data, size, block, ranges);
+                }
+                return ranges;
+            }
+        }
+
+        for(size_t position = 0; position < size;)
+        {
+            position = add_block_range(data, size, position, ranges);
+        }
+        return ranges;
+    }
+
+    // Adds the records of the block at position and returns the position after
+    // the block, or size if there is no valid block header.
+    size_t add_block_range(const uint8_t* data, const size_t& size,
+                           const size_t& position, std::vector<chunk_t>& ranges) const
+    {
+        block_header_t header;
+        if(position > size || size - position < sizeof(header))
+        {
+            report_bad_block(position);
+            return size;
+        }
+
+        std::memcpy(&header, data + position, sizeof(header));
+        if(header.magic != block_magic ||
+           header.length > size - position - sizeof(header))
+        {
+            report_bad_block(position);
+            return size;
+        }
+
+        const size_t records = position + sizeof(header);
+        if((header.flags & block_flag_index) == 0 && verify_block(header, data + records))
+        {
+            ranges.push_back({ records, records + header.length });
+        }
+        return records + header.length;
+    }
+
+    std::optional<std::vector<uint64_t>> find_indexed_blocks(const uint8_t* data,
+                                                             const size_t&  size) const
+    {
+        index_trailer_t trailer;
+        block_header_t  header;
+        if(size < sizeof(trailer) + sizeof(header))
+        {
+            return std::nullopt;
+        }
+
+        std::memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+        if(trailer.magic != index_magic ||
+           trailer.index_offset > size - sizeof(trailer) - sizeof(header))
+        {
+            return std::nullopt;
+        }
+
+        std::memcpy(&header, data + trailer.index_offset, sizeof(header));
+        if(header.length > size - trailer.index_offset - sizeof(header))
+        {
+            return std::nullopt;
+        }
+        return parse_type_index(header, data + trailer.index_offset + sizeof(header));
+    }
+
+    // Only headers are read here, so finding the boundaries is cheap compared to
+    // deserializing the samples.
+    void split_into_chunks(const uint8_t* data, const chunk_t& range,
+                           std::vector<chunk_t>& chunks) const
+    {
+        sample_header header;
+        size_t        begin    = range.begin;
+        size_t        position = range.begin;
+
+        while(range.end - position >= sizeof(header))
+        {
+            std::memcpy(&header, data + position, sizeof(header));
+            position += sizeof(header);
+            position += std::min(header.sample_size, range.end - position);
+
+            if(position - begin >= m_config.chunk_size)
+            {
+                chunks.push_back({ begin, position });
+                begin = position;
+            }
+        }
+
+        if(begin < range.end)
+        {
+            chunks.push_back({ begin, range.end });
+        }
+    }
+
+    // TypeProcessing must be safe to call from several threads at once.
+    void load_unordered(uint8_t* data, const std::vector<chunk_t>& chunks)
+    {
+        std::atomic<size_t> next_chunk{ 0 };
+        std::mutex          error_mutex;
+        std::exception_ptr  error;
+
+        auto _parse = [&]() {
+            try
+            {
+                for(size_t i = next_chunk++; i < chunks.size(); i = next_chunk++)
+                {
+                    for_each_record(data, chunks[i],
+                                    [&](TypeIdentifierEnum type, uint8_t* sample_data) {
+                                        m_decoder.process_record(type, sample_data);
+                                    });
+                }
+            } catch(...)
+            {
+                std::lock_guard _lock{ error_mutex };
+                if(!error)
+                {
+                    error = std::current_exception();
+                }
+                next_chunk = chunks.size();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for(size_t i = 1; i < m_config.threads; ++i)
+        {
+            workers.emplace_back(_parse);
+        }
+        _parse();
+
+        for(auto& worker : workers)
+        {
+            worker.join();
+        }
+
+        if(error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Worker threads deserialize chunks ahead of the loading thread, which hands
+    // them to TypeProcessing in file order. At most two chunks per worker are
+    // kept in memory.
+    void load_ordered(uint8_t* data, const std::vector<chunk_t>& chunks)
+    {
+        struct parsed_chunk_t
+        {
+            std::vector<parsed_sample_t> samples;
+            std::exception_ptr           error;
+            bool                         ready{ false };
+        };
+
+        const size_t                window = 2 * m_config.threads;
+        std::vector<parsed_chunk_t> parsed(chunks.size());
+        std::atomic<size_t>         next_chunk{ 0 };
+        std::mutex                  mutex;
+        std::condition_variable     condition;
+        size_t                      delivered = 0;
+        bool                        stopped   = false;
+
+        auto _parse = [&]() {
+            for(size_t i = next_chunk++; i < chunks.size(); i = next_chunk++)
+            {
+                {
+                    std::unique_lock _lock{ mutex };
+                    condition.wait(_lock,
+                                   [&]() { return stopped || i < delivered + window; });
+                    if(stopped)
+                    {
+                        return;
+                    }
+                }
+
+                std::vector<parsed_sample_t> samples;
+                std::exception_ptr           error;
+                try
+                {
+                    for_each_record(data, chunks[i],
+                                    [&](TypeIdentifierEnum type, uint8_t* sample_data) {
+                                        samples.emplace_back(
+                                            type, m_decoder.decode(type, sample_data));
+                                    });
+                } catch(...)
+                {
+                    error = std::current_exception();
+                }
+
+                {
+                    std::lock_guard _lock{ mutex };
+                    parsed[i].samples = std::move(samples);
+                    parsed[i].error   = error;
+                    parsed[i].ready   = true;
+                }
+                condition.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for(size_t i = 0; i < m_config.threads; ++i)
+        {
+            workers.emplace_back(_parse);
+        }
+
+        auto _stop_workers = [&]() {
+            {
+                std::lock_guard _lock{ mutex };
+                stopped = true;
+            }
+            condition.notify_all();
+            for(auto& worker : workers)
+            {
+                worker.join();
+            }
+        };
+
+        try
+        {
+            for(size_t i = 0; i < chunks.size(); ++i)
+            {
+                std::vector<parsed_sample_t> samples;
+                {
+                    std::unique_lock _lock{ mutex };
+                    condition.wait(_lock, [&]() { return parsed[i].ready; });
+                    if(parsed[i].error)
+                    {
+                        std::rethrow_exception(parsed[i].error);
+                    }
+                    samples = std::move(parsed[i].samples);
+                }
+
+                for(auto& sample : samples)
+                {
+                    m_decoder.deliver_sample(sample.first, std::move(sample.second));
+                }
+
+                {
+                    std::lock_guard _lock{ mutex };
+                    delivered = i + 1;
+                }
+                condition.notify_all();
+            }
+        } catch(...)
+        {
+            _stop_workers();
+            throw;
+        }
+
+        _stop_workers();
+    }
+
     std::string                            m_filename;
     std::unique_ptr<TypeProcessing>        m_type_processing;
+    storage_parser_config_t                m_config;
     std::unique_ptr<std::function<void()>> m_on_finished_callback{ nullptr };
-    type_registry<TypeIdentifierEnum, SupportedTypes...> m_registry;
+    decoder_t                              m_decoder{ *m_type_processing };
 };
 
 }  // namespace trace_cache
\ No newline at end of file
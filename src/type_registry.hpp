@@ -1,47 +1,71 @@
 #pragma once
 #include "cache_type_traits.hpp"
-#include <functional>
-#include <map>
+#include <cstddef>
 #include <optional>
+#include <utility>
+#include <variant>
 
 namespace trace_cache
 {
-
 template <typename TypeIdentifierEnum, typename... SupportedTypes>
 class type_registry
 {
     static_assert(type_traits::is_enum_class_v<TypeIdentifierEnum>,
                   "TypeIdentifierEnum must be an enum class");
+    static_assert(
+        (type_traits::has_type_identifier<SupportedTypes, TypeIdentifierEnum>::value &&
+         ...),
+        "Type must have type_identifier");
+    static_assert((type_traits::has_deserialize<SupportedTypes>::value && ...),
+                  "Type must have deserialize function");
+    static_assert(
+        type_traits::has_unique_identifiers<TypeIdentifierEnum, SupportedTypes...>(),
+        "Type identifiers must be unique");
 
 public:
     using variant_t = typename std::variant<SupportedTypes...>;
 
-    type_registry() { (register_type<SupportedTypes>(), ...); }
+    std::optional<variant_t> get_type(TypeIdentifierEnum id, uint8_t*& data) const
+    {
+        std::optional<variant_t> result;
+        dispatch(id, data, [&](auto&& sample) {
+            using type_t = std::decay_t<decltype(sample)>;
+            result.emplace(std::in_place_type<type_t>, std::move(sample));
+        });
+        return result;
+    }
 
-    std::optional<variant_t> get_type(TypeIdentifierEnum id, uint8_t*& data)
+    // Position of the type with the given identifier in SupportedTypes, or
+    // sizeof...(SupportedTypes) for identifiers of unsupported types.
+    static constexpr size_t index_of(TypeIdentifierEnum id)
     {
-        auto it = deserializers.find(id);
-        if(it != deserializers.end())
-        {
-            return it->second(data);
-        }
-        return std::nullopt;
+        size_t _index = 0;
+        (void) (... && (id != SupportedTypes::type_identifier && (++_index, true)));
+        return _index;
     }
 
-private:
-    std::map<TypeIdentifierEnum, std::function<variant_t(uint8_t*&)>> deserializers;
+    // Deserializes the sample with the given identifier and passes it to
+    // visitor as its concrete type. The lookup is folded over SupportedTypes at
+    // compile time. Returns false, without touching data, for unknown ids.
+    template <typename Visitor>
+    bool dispatch(TypeIdentifierEnum id, uint8_t*& data, Visitor&& visitor) const
+    {
+        return (dispatch_as<SupportedTypes>(id, data, visitor) || ...);
+    }
 
-    template <typename T>
-    inline void register_type()
+private:
+    template <typename T, typename Visitor>
+    __attribute__((always_inline)) inline static bool dispatch_as(TypeIdentifierEnum id,
+                                                                  uint8_t*& data,
+                                                                  Visitor&  visitor)
     {
-        static_assert(type_traits::has_type_identifier<T, TypeIdentifierEnum>::value,
-                      "Type must have type_identifier");
-        static_assert(type_traits::has_deserialize<T>::value,
-                      "Type must have deserialize function");
-        deserializers[T::type_identifier] = [](uint8_t*& data) -> variant_t {
-            return deserialize<T>(data);
-        };
+        if(id != T::type_identifier)
+        {
+            return false;
+        }
+        visitor(deserialize<T>(data));
+        return true;
     }
 };
 
-}  // namespace trace_cache
\ No newline at end of file
+}  // namespace trace_cache
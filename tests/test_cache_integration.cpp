@@ -4,6 +4,7 @@
 
 #include <atomic>
 #include <chrono>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <memory>
 #include <random>
@@ -536,3 +537,589 @@ TEST_F(CachingModuleIntegrationTest, concurrent_write_read_validation)
     EXPECT_EQ(processor_ptr->get_sample_1_count(), total_samples);
     EXPECT_TRUE(processor_ptr->all_expected_samples_found());
 }
+
+TEST_F(CachingModuleIntegrationTest, follow_file_while_writing)
+{
+    const int                  batch_size = 1000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples;
+    for(int i = 0; i < 2 * batch_size; ++i)
+    {
+        texts.push_back("follow_" + std::to_string(i));
+    }
+    for(int i = 0; i < 2 * batch_size; ++i)
+    {
+        samples.emplace_back(i, texts[i]);
+    }
+
+    trace_cache::buffered_storage_config_t storage_config;
+    storage_config.flush_interval       = std::chrono::milliseconds{ 5 };
+    storage_config.end_of_stream_marker = true;
+
+    trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                  test_type_identifier_t>
+        storage(test_file_path, storage_config);
+    storage.start();
+
+    auto processor = std::make_unique<integration_sample_processor_t>();
+    processor->set_expected_samples_1(samples);
+    auto processor_ptr = processor.get();
+
+    trace_cache::storage_parser_config_t parser_config;
+    parser_config.read_mode            = trace_cache::parser_read_mode_t::follow;
+    parser_config.follow_poll_interval = std::chrono::milliseconds{ 1 };
+    parser_config.follow_idle_timeout  = std::chrono::seconds{ 30 };
+
+    trace_cache::storage_parser<test_type_identifier_t, integration_sample_processor_t,
+                                test_sample_1, test_sample_2, test_sample_3>
+        parser(test_file_path, std::move(processor), parser_config);
+
+    std::thread follower([&parser]() { EXPECT_NO_THROW(parser.load()); });
+
+    for(int i = 0; i < batch_size; ++i)
+    {
+        storage.store(samples[i]);
+    }
+
+    // The first batch is parsed while the storage is still running.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 10 };
+    while(processor_ptr->get_sample_1_count() < batch_size &&
+          std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+    }
+    EXPECT_EQ(processor_ptr->get_sample_1_count(), batch_size);
+
+    for(int i = batch_size; i < 2 * batch_size; ++i)
+    {
+        storage.store(samples[i]);
+    }
+    storage.shutdown();
+    follower.join();
+
+    EXPECT_EQ(processor_ptr->get_sample_1_count(), 2 * batch_size);
+    EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    EXPECT_FALSE(std::ifstream(test_file_path).good());
+}
+
+TEST_F(CachingModuleIntegrationTest, direct_consumer_without_file)
+{
+    const int                  sample_count = 20000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        texts.push_back("direct_" + std::to_string(i));
+    }
+    for(int i = 0; i < sample_count; ++i)
+    {
+        samples.emplace_back(i, texts[i]);
+    }
+
+    integration_sample_processor_t processor;
+    processor.set_expected_samples_1(samples);
+
+    trace_cache::sample_decoder<test_type_identifier_t, integration_sample_processor_t,
+                                test_sample_1, test_sample_2, test_sample_3>
+        decoder(processor);
+
+    // Small buffer, so the ring wraps and is flushed many times.
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size          = 64 * trace_cache::KByte;
+    config.flush_threshold      = 32 * trace_cache::KByte;
+    config.end_of_stream_marker = true;
+    config.consumer             = [&decoder](uint8_t* data, size_t size) {
+        decoder.consume(data, size);
+    };
+
+    trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                  test_type_identifier_t>
+        storage(test_file_path, config);
+    storage.start();
+
+    for(const auto& sample : samples)
+    {
+        storage.store(sample);
+    }
+    storage.shutdown();
+
+    EXPECT_EQ(processor.get_sample_1_count(), sample_count);
+    EXPECT_TRUE(processor.all_expected_samples_found());
+    EXPECT_TRUE(decoder.end_of_stream());
+    EXPECT_EQ(decoder.pending_bytes(), 0);
+    EXPECT_FALSE(std::ifstream(test_file_path).good());
+}
+
+TEST_F(CachingModuleIntegrationTest, framed_file_in_every_read_mode)
+{
+    const int                  sample_count = 5000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        texts.push_back("framed_" + std::to_string(i));
+    }
+    for(int i = 0; i < sample_count; ++i)
+    {
+        samples.emplace_back(i, texts[i]);
+    }
+
+    std::vector<trace_cache::storage_parser_config_t> parser_configs(6);
+    parser_configs[0].read_mode           = trace_cache::parser_read_mode_t::stream;
+    parser_configs[1].read_mode           = trace_cache::parser_read_mode_t::mmap;
+    parser_configs[2].threads             = 2;
+    parser_configs[2].chunk_size          = 4 * trace_cache::KByte;
+    parser_configs[3].threads             = 2;
+    parser_configs[3].chunk_size          = 4 * trace_cache::KByte;
+    parser_configs[3].delivery            = trace_cache::parser_delivery_t::unordered;
+    parser_configs[4].read_mode           = trace_cache::parser_read_mode_t::follow;
+    parser_configs[4].follow_idle_timeout = std::chrono::seconds{ 30 };
+    // Blocks and their headers are split across the read-ahead buffers.
+    parser_configs[5].read_mode          = trace_cache::parser_read_mode_t::read_ahead;
+    parser_configs[5].read_ahead_size    = 3000;
+    parser_configs[5].read_ahead_buffers = 2;
+
+    for(const auto& parser_config : parser_configs)
+    {
+        // A small buffer and threshold spread the samples over many blocks.
+        trace_cache::buffered_storage_config_t config;
+        config.buffer_size          = 64 * trace_cache::KByte;
+        config.flush_threshold      = 16 * trace_cache::KByte;
+        config.file_format          = trace_cache::file_format_t::framed;
+        config.block_checksum       = true;
+        config.end_of_stream_marker = true;
+        {
+            trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                          test_type_identifier_t>
+                storage(test_file_path, config);
+            storage.start();
+            for(const auto& sample : samples)
+            {
+                storage.store(sample);
+            }
+            storage.shutdown();
+        }
+
+        auto processor = std::make_unique<integration_sample_processor_t>();
+        processor->set_expected_samples_1(samples);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser<test_type_identifier_t,
+                                    integration_sample_processor_t, test_sample_1,
+                                    test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), parser_config);
+        parser.load();
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), sample_count);
+        EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    }
+}
+
+template <typename WorkerFactory>
+void
+store_and_parse(const std::string& filepath, const std::vector<test_sample_1>& samples)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size     = 64 * trace_cache::KByte;
+    config.flush_threshold = 16 * trace_cache::KByte;
+    {
+        trace_cache::buffered_storage<WorkerFactory, test_type_identifier_t> storage(
+            filepath, config);
+        storage.start();
+        for(const auto& sample : samples)
+        {
+            storage.store(sample);
+        }
+        storage.shutdown();
+    }
+
+    auto processor = std::make_unique<integration_sample_processor_t>();
+    processor->set_expected_samples_1(samples);
+    auto processor_ptr = processor.get();
+
+    trace_cache::storage_parser<test_type_identifier_t, integration_sample_processor_t,
+                                test_sample_1, test_sample_2, test_sample_3>
+        parser(filepath, std::move(processor));
+    parser.load();
+
+    EXPECT_EQ(processor_ptr->get_sample_1_count(), samples.size());
+    EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+}
+
+TEST_F(CachingModuleIntegrationTest, every_sink_round_trips)
+{
+    const int                  sample_count = 5000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        texts.push_back("sink_" + std::to_string(i));
+    }
+    for(int i = 0; i < sample_count; ++i)
+    {
+        samples.emplace_back(i, texts[i]);
+    }
+
+    store_and_parse<trace_cache::flush_worker_factory_t>(test_file_path, samples);
+    store_and_parse<trace_cache::direct_flush_worker_factory_t>(test_file_path,
+                                                               samples);
+    store_and_parse<trace_cache::ofstream_flush_worker_factory_t>(test_file_path,
+                                                                 samples);
+}
+
+TEST_F(CachingModuleIntegrationTest, mapped_output_file)
+{
+    const int thread_count       = 4;
+    const int samples_per_thread = 1000;
+
+    // Payloads of up to a few pages wrap the ring at every possible offset and
+    // keep writers waiting on partly flushed pages.
+    std::vector<std::vector<std::string>> thread_strings(thread_count);
+    std::vector<test_sample_1>            expected_1;
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            thread_strings[t].push_back(std::string((i * 37 + t) % 9000, 'a' + t) +
+                                        std::to_string(i));
+        }
+    }
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            expected_1.emplace_back(t, thread_strings[t][i]);
+        }
+    }
+
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size          = 64 * trace_cache::KByte + 1;
+    config.flush_threshold      = 16 * trace_cache::KByte;
+    config.allocation           = trace_cache::buffer_allocation_t::mapped_file;
+    config.end_of_stream_marker = true;
+
+    trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                  test_type_identifier_t>
+        storage(test_file_path, config);
+
+    std::vector<trace_cache::storage_parser_config_t> parser_configs(2);
+    parser_configs[0].read_mode           = trace_cache::parser_read_mode_t::stream;
+    parser_configs[1].read_mode           = trace_cache::parser_read_mode_t::follow;
+    parser_configs[1].follow_idle_timeout = std::chrono::seconds{ 30 };
+
+    // Every start writes a new file.
+    for(const auto& parser_config : parser_configs)
+    {
+        storage.start();
+        std::vector<std::thread> writers;
+        for(int t = 0; t < thread_count; ++t)
+        {
+            writers.emplace_back([&, thread_id = t]() {
+                for(const auto& text : thread_strings[thread_id])
+                {
+                    storage.store(test_sample_1(thread_id, text));
+                }
+            });
+        }
+        for(auto& writer : writers)
+        {
+            writer.join();
+        }
+        storage.shutdown();
+
+        auto processor = std::make_unique<integration_sample_processor_t>();
+        processor->set_expected_samples_1(expected_1);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser<test_type_identifier_t,
+                                    integration_sample_processor_t, test_sample_1,
+                                    test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), parser_config);
+        parser.load();
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), thread_count * samples_per_thread);
+        EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    }
+}
+
+TEST_F(CachingModuleIntegrationTest, segmented_buffer)
+{
+    const int thread_count       = 4;
+    const int samples_per_thread = 2000;
+
+    std::vector<std::vector<std::string>> thread_strings(thread_count);
+    std::vector<test_sample_1>            expected_1;
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            thread_strings[t].push_back(std::string(i % 700, 'a' + t) +
+                                        std::to_string(i));
+        }
+    }
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            expected_1.emplace_back(t, thread_strings[t][i]);
+        }
+    }
+
+    // Framed, every segment is a block of its own.
+    std::vector<trace_cache::buffered_storage_config_t> configs(3);
+    configs[1].staging_buffer_size = 2 * trace_cache::KByte;
+    configs[2].file_format         = trace_cache::file_format_t::framed;
+    configs[2].block_checksum      = true;
+
+    for(auto& config : configs)
+    {
+        config.buffer_size   = 64 * trace_cache::KByte;
+        config.segment_count = 4;
+        {
+            trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                          test_type_identifier_t>
+                storage(test_file_path, config);
+            storage.start();
+
+            std::vector<std::thread> writers;
+            for(int t = 0; t < thread_count; ++t)
+            {
+                writers.emplace_back([&, thread_id = t]() {
+                    for(const auto& text : thread_strings[thread_id])
+                    {
+                        storage.store(test_sample_1(thread_id, text));
+                    }
+                });
+            }
+            for(auto& writer : writers)
+            {
+                writer.join();
+            }
+            storage.shutdown();
+        }
+
+        auto processor = std::make_unique<integration_sample_processor_t>();
+        processor->set_expected_samples_1(expected_1);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser<test_type_identifier_t,
+                                    integration_sample_processor_t, test_sample_1,
+                                    test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor));
+        parser.load();
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), thread_count * samples_per_thread);
+        EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    }
+}
+
+TEST_F(CachingModuleIntegrationTest, out_of_line_samples)
+{
+    const int thread_count       = 4;
+    const int samples_per_thread = 1000;
+
+    // Every hundredth sample is larger than the whole buffer.
+    std::vector<std::vector<std::string>> thread_strings(thread_count);
+    std::vector<test_sample_1>            expected_1;
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            const size_t length = i % 100 == 0 ? 80 * trace_cache::KByte : i % 300;
+            thread_strings[t].push_back(std::string(length, 'a' + t) +
+                                        std::to_string(i));
+        }
+    }
+    for(int t = 0; t < thread_count; ++t)
+    {
+        for(int i = 0; i < samples_per_thread; ++i)
+        {
+            expected_1.emplace_back(t, thread_strings[t][i]);
+        }
+    }
+
+    std::vector<trace_cache::buffered_storage_config_t> configs(4);
+    configs[1].segment_count       = 4;
+    configs[2].staging_buffer_size = 2 * trace_cache::KByte;
+    configs[2].out_of_line_size    = 8 * trace_cache::KByte;
+    configs[3].file_format         = trace_cache::file_format_t::framed;
+
+    for(auto& config : configs)
+    {
+        config.buffer_size = 64 * trace_cache::KByte;
+        {
+            trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                          test_type_identifier_t>
+                storage(test_file_path, config);
+            storage.start();
+
+            std::vector<std::thread> writers;
+            for(int t = 0; t < thread_count; ++t)
+            {
+                writers.emplace_back([&, thread_id = t]() {
+                    for(const auto& text : thread_strings[thread_id])
+                    {
+                        storage.store(test_sample_1(thread_id, text));
+                    }
+                });
+            }
+            for(auto& writer : writers)
+            {
+                writer.join();
+            }
+            storage.shutdown();
+            EXPECT_EQ(storage.stats().dropped_samples, 0);
+            EXPECT_EQ(storage.stats().overflow_samples, 0);
+            EXPECT_EQ(storage.stats().out_of_line_samples,
+                      thread_count * samples_per_thread / 100);
+        }
+
+        auto processor = std::make_unique<integration_sample_processor_t>();
+        processor->set_expected_samples_1(expected_1);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser<test_type_identifier_t,
+                                    integration_sample_processor_t, test_sample_1,
+                                    test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor));
+        parser.load();
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), thread_count * samples_per_thread);
+        EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    }
+}
+
+TEST_F(CachingModuleIntegrationTest, framed_file_skips_corrupted_block)
+{
+    const int                  sample_count = 2000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        texts.push_back("corrupted_" + std::to_string(i));
+    }
+    for(int i = 0; i < sample_count; ++i)
+    {
+        samples.emplace_back(i, texts[i]);
+    }
+
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size     = 64 * trace_cache::KByte;
+    config.flush_threshold = 16 * trace_cache::KByte;
+    config.file_format     = trace_cache::file_format_t::framed;
+    config.block_checksum  = true;
+    {
+        trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                      test_type_identifier_t>
+            storage(test_file_path, config);
+        storage.start();
+        for(const auto& sample : samples)
+        {
+            storage.store(sample);
+        }
+        storage.shutdown();
+    }
+
+    // Flip a byte in the records of the first block.
+    trace_cache::block_header_t header;
+    {
+        std::fstream file(test_file_path,
+                          std::ios::binary | std::ios::in | std::ios::out);
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        ASSERT_LT(header.record_count, static_cast<size_t>(sample_count));
+
+        char byte = 0;
+        file.seekg(sizeof(header) + header.length / 2);
+        file.read(&byte, 1);
+        byte ^= 0x01;
+        file.seekp(sizeof(header) + header.length / 2);
+        file.write(&byte, 1);
+    }
+
+    auto processor     = std::make_unique<integration_sample_processor_t>();
+    auto processor_ptr = processor.get();
+    processor->set_expected_samples_1(
+        std::vector<test_sample_1>(samples.begin() + header.record_count, samples.end()));
+
+    trace_cache::storage_parser<test_type_identifier_t, integration_sample_processor_t,
+                                test_sample_1, test_sample_2, test_sample_3>
+        parser(test_file_path, std::move(processor));
+    parser.load();
+
+    EXPECT_EQ(processor_ptr->get_sample_1_count(),
+              sample_count - static_cast<int>(header.record_count));
+    EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+}
+
+TEST_F(CachingModuleIntegrationTest, type_filtered_read_uses_index)
+{
+    const int                  sample_count = 5000;
+    std::vector<std::string>   texts;
+    std::vector<test_sample_1> samples_1;
+    std::vector<test_sample_3> samples_3;
+    for(int i = 0; i < sample_count; ++i)
+    {
+        texts.push_back("indexed_" + std::to_string(i));
+        samples_3.emplace_back(std::vector<uint8_t>{ static_cast<uint8_t>(i), 0x03 });
+    }
+    for(int i = 0; i < sample_count; ++i)
+    {
+        samples_1.emplace_back(i, texts[i]);
+    }
+
+    std::vector<trace_cache::storage_parser_config_t> parser_configs(3);
+    parser_configs[0].read_mode  = trace_cache::parser_read_mode_t::stream;
+    parser_configs[1].read_mode  = trace_cache::parser_read_mode_t::mmap;
+    parser_configs[2].threads    = 2;
+    parser_configs[2].chunk_size = 4 * trace_cache::KByte;
+
+    for(const auto& parser_config : parser_configs)
+    {
+        trace_cache::buffered_storage_config_t config;
+        config.buffer_size     = 64 * trace_cache::KByte;
+        config.flush_threshold = 16 * trace_cache::KByte;
+        config.file_format     = trace_cache::file_format_t::framed;
+        config.type_index      = true;
+        {
+            trace_cache::buffered_storage<trace_cache::flush_worker_factory_t,
+                                          test_type_identifier_t>
+                storage(test_file_path, config);
+            storage.start();
+            for(const auto& sample : samples_1)
+            {
+                storage.store(sample);
+            }
+            for(const auto& sample : samples_3)
+            {
+                storage.store(sample);
+            }
+            storage.shutdown();
+        }
+
+        // The first block only holds test_sample_1. A parser scanning the file
+        // would stop at its broken length, the index lets it skip the block.
+        {
+            std::fstream file(test_file_path,
+                              std::ios::binary | std::ios::in | std::ios::out);
+            const uint64_t broken_length = ~uint64_t{ 0 };
+            file.seekp(offsetof(trace_cache::block_header_t, length));
+            file.write(reinterpret_cast<const char*>(&broken_length),
+                       sizeof(broken_length));
+        }
+
+        auto processor = std::make_unique<integration_sample_processor_t>();
+        processor->set_expected_samples_3(samples_3);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser<test_type_identifier_t,
+                                    integration_sample_processor_t, test_sample_1,
+                                    test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), parser_config);
+        parser.set_type_filter({ test_type_identifier_t::sample_type_3 });
+        parser.load();
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), 0);
+        EXPECT_EQ(processor_ptr->get_sample_3_count(), sample_count);
+        EXPECT_TRUE(processor_ptr->all_expected_samples_found());
+    }
+}
@@ -2,8 +2,10 @@
 #include "mocked_types.hpp"
 
 #include "gmock/gmock.h"
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstring>
 #include <gtest/gtest.h>
 #include <memory>
 #include <sstream>
@@ -32,6 +34,34 @@ verify_buffer_contains(const T& sample, const uint8_t* buffer, size_t& buffer_po
     buffer_pos += size;
 }
 
+// Returns the first payload byte of every test_sample_3 in the flushed output.
+std::vector<uint8_t>
+get_sample_3_markers(const std::string& buffer_data)
+{
+    std::vector<uint8_t> markers;
+    const uint8_t*       buffer = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t               buffer_pos = 0;
+
+    while(buffer_pos < buffer_data.size())
+    {
+        auto type_id =
+            *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+        buffer_pos += sizeof(test_type_identifier_t);
+
+        auto size = *reinterpret_cast<const size_t*>(buffer + buffer_pos);
+        buffer_pos += sizeof(size_t);
+
+        if(type_id == test_type_identifier_t::sample_type_3)
+        {
+            uint8_t* data = const_cast<uint8_t*>(buffer + buffer_pos);
+            auto     sample = trace_cache::deserialize<test_sample_3>(data);
+            markers.push_back(sample.payload.at(0));
+        }
+        buffer_pos += size;
+    }
+    return markers;
+}
+
 struct mock_worker_t
 {
     explicit mock_worker_t(trace_cache::worker_function_t            worker_function,
@@ -46,12 +76,10 @@ struct mock_worker_t
     MOCK_METHOD(void, start, (const pid_t&) );
     MOCK_METHOD(void, stop, (const pid_t&) );
 
-    void execute_flush(bool force = false)
-    {
-        m_worker_function(m_output_string_stream, force);
-    }
+    void execute_flush(bool force = false) { m_worker_function(m_output_sink, force); }
 
-    std::ostringstream m_output_string_stream;
+    std::ostringstream          m_output_string_stream;
+    trace_cache::ostream_sink_t m_output_sink{ m_output_string_stream };
 
     trace_cache::worker_function_t            m_worker_function;
     trace_cache::worker_synchronization_ptr_t m_sync;
@@ -124,8 +152,10 @@ protected:
             g_mock_worker->m_sync->is_running = true;
         });
 
+        // Like the flush worker, flushes after stop are final.
         ON_CALL(*g_mock_worker, stop).WillByDefault([] {
             g_mock_worker->m_sync->is_running = false;
+            g_mock_worker->m_sync->closing    = true;
         });
     }
 };
@@ -461,3 +491,1179 @@ TEST_F(BufferedStorageTest, repeated_fragmentation)
     EXPECT_EQ(sample3_count, cycle_count * iter_count);
     EXPECT_GT(fragmented_space_count, 0);
 }
+
+TEST_F(BufferedStorageTest, concurrent_store_across_wrap)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    // Move the head close to the end of the buffer so concurrent writers race on wrap.
+    std::vector<uint8_t> filler(trace_cache::buffer_size / 2, 0x11);
+    storage.store(test_sample_3(filler));
+    g_mock_worker->execute_flush(true);
+    g_mock_worker->m_output_string_stream.str("");
+
+    const int                num_threads      = 16;
+    const int                items_per_thread = 60;
+    const size_t             payload_size     = 64 * trace_cache::KByte;
+    std::vector<std::thread> threads;
+
+    for(int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<uint8_t> payload(payload_size, static_cast<uint8_t>(t));
+            for(int i = 0; i < items_per_thread; ++i)
+            {
+                EXPECT_NO_THROW(storage.store(test_sample_3(payload)));
+            }
+        });
+    }
+
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = 0;
+    size_t         fragmented_space_count = 0;
+
+    std::vector<int> per_thread_count(num_threads, 0);
+
+    while(buffer_pos < buffer_data.size())
+    {
+        auto type_id =
+            *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+        buffer_pos += sizeof(test_type_identifier_t);
+
+        auto size = *reinterpret_cast<const size_t*>(buffer + buffer_pos);
+        buffer_pos += sizeof(size_t);
+
+        if(type_id == test_type_identifier_t::fragmented_space)
+        {
+            fragmented_space_count++;
+        }
+        else
+        {
+            ASSERT_EQ(type_id, test_type_identifier_t::sample_type_3);
+            uint8_t* data   = const_cast<uint8_t*>(buffer + buffer_pos);
+            auto     sample = trace_cache::deserialize<test_sample_3>(data);
+            ASSERT_EQ(sample.payload.size(), payload_size);
+            ASSERT_LT(sample.payload.front(), num_threads);
+            EXPECT_EQ(sample.payload,
+                      std::vector<uint8_t>(payload_size, sample.payload.front()));
+            per_thread_count[sample.payload.front()]++;
+        }
+        buffer_pos += size;
+    }
+
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+    EXPECT_EQ(fragmented_space_count, 1);
+    for(int count : per_thread_count)
+    {
+        EXPECT_EQ(count, items_per_thread);
+    }
+}
+
+TEST_F(BufferedStorageTest, concurrent_flush_writes_only_committed_samples)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const int                num_threads      = 8;
+    const int                items_per_thread = 2000;
+    const size_t             payload_size     = 512;
+    std::atomic<bool>        writers_done{ false };
+    std::vector<std::thread> threads;
+
+    std::thread flusher([&]() {
+        while(!writers_done)
+        {
+            g_mock_worker->execute_flush(true);
+        }
+        g_mock_worker->execute_flush(true);
+    });
+
+    for(int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<uint8_t> payload(payload_size, static_cast<uint8_t>(t + 1));
+            for(int i = 0; i < items_per_thread; ++i)
+            {
+                storage.store(test_sample_3(payload));
+            }
+        });
+    }
+
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+    writers_done = true;
+    flusher.join();
+
+    EXPECT_NO_THROW(storage.shutdown());
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = 0;
+    int            samples     = 0;
+
+    while(buffer_pos < buffer_data.size())
+    {
+        auto type_id =
+            *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+        ASSERT_EQ(type_id, test_type_identifier_t::sample_type_3);
+        buffer_pos += sizeof(test_type_identifier_t);
+
+        auto size = *reinterpret_cast<const size_t*>(buffer + buffer_pos);
+        ASSERT_EQ(size, payload_size + sizeof(size_t));
+        buffer_pos += sizeof(size_t);
+
+        uint8_t* data   = const_cast<uint8_t*>(buffer + buffer_pos);
+        auto     sample = trace_cache::deserialize<test_sample_3>(data);
+        ASSERT_EQ(sample.payload,
+                  std::vector<uint8_t>(payload_size, sample.payload.front()));
+        buffer_pos += size;
+        samples++;
+    }
+
+    EXPECT_EQ(samples, num_threads * items_per_thread);
+}
+
+class BufferedStorageOverrunTest : public BufferedStorageTest
+{
+protected:
+    static constexpr size_t sample_payload_size = trace_cache::buffer_size / 5;
+
+    // Five samples of this size need more than the whole buffer.
+    static test_sample_3 get_large_sample(uint8_t marker)
+    {
+        return test_sample_3(std::vector<uint8_t>(sample_payload_size, marker));
+    }
+
+    static trace_cache::buffered_storage_config_t get_config(
+        trace_cache::overrun_policy_t policy)
+    {
+        trace_cache::buffered_storage_config_t config;
+        config.overrun_policy = policy;
+        return config;
+    }
+};
+
+TEST_F(BufferedStorageOverrunTest, drop_newest_policy)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, get_config(trace_cache::overrun_policy_t::drop_newest));
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+    for(uint8_t marker = 1; marker <= 5; ++marker)
+    {
+        EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+    }
+    EXPECT_EQ(storage.stats().dropped_samples, 1);
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 1, 2, 3, 4 }));
+}
+
+TEST_F(BufferedStorageOverrunTest, drop_oldest_policy)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, get_config(trace_cache::overrun_policy_t::drop_oldest));
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+    for(uint8_t marker = 1; marker <= 5; ++marker)
+    {
+        EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+    }
+    // The wrapped sample must end strictly before the tail, so two samples go.
+    EXPECT_EQ(storage.stats().dropped_samples, 2);
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 3, 4, 5 }));
+}
+
+TEST_F(BufferedStorageOverrunTest, grow_policy)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, get_config(trace_cache::overrun_policy_t::grow));
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+    for(uint8_t marker = 1; marker <= 6; ++marker)
+    {
+        EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+    }
+    EXPECT_EQ(storage.stats().overflow_samples, 2);
+    EXPECT_EQ(storage.stats().dropped_samples, 0);
+
+    g_mock_worker->execute_flush();
+    EXPECT_NO_THROW(storage.store(get_large_sample(7)));
+    EXPECT_EQ(storage.stats().overflow_samples, 2);
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 1, 2, 3, 4, 5, 6, 7 }));
+}
+
+TEST_F(BufferedStorageOverrunTest, block_policy)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, get_config(trace_cache::overrun_policy_t::block));
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+    for(uint8_t marker = 1; marker <= 4; ++marker)
+    {
+        EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+    }
+
+    std::atomic<bool> stored{ false };
+    std::thread       writer([&]() {
+        EXPECT_NO_THROW(storage.store(get_large_sample(5)));
+        stored = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(stored);
+
+    while(!stored)
+    {
+        g_mock_worker->execute_flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    writer.join();
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(storage.stats().dropped_samples, 0);
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 1, 2, 3, 4, 5 }));
+}
+
+TEST_F(BufferedStorageOverrunTest, sample_larger_than_buffer)
+{
+    // Too large for the buffer, for a segment, and over the configured size.
+    std::vector<trace_cache::buffered_storage_config_t> configs(3);
+    configs[1].segment_count    = 4;
+    configs[2].out_of_line_size = 4 * trace_cache::KByte;
+
+    const std::vector<size_t> large_sizes{ 64 * trace_cache::KByte,
+                                           32 * trace_cache::KByte,
+                                           4 * trace_cache::KByte };
+
+    for(size_t i = 0; i < configs.size(); ++i)
+    {
+        configs[i].buffer_size = 64 * trace_cache::KByte;
+        trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>
+            storage(test_file_path, configs[i]);
+        SetUpStartStopOnCall();
+        EXPECT_CALL(*g_mock_worker, start).Times(1);
+        EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+        storage.start();
+        EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(16, 1))));
+        EXPECT_NO_THROW(
+            storage.store(test_sample_3(std::vector<uint8_t>(large_sizes[i], 2))));
+        EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(16, 3))));
+        g_mock_worker->execute_flush();
+        EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(16, 4))));
+
+        auto reservation = storage.reserve<test_sample_3>(
+            trace_cache::get_size(test_sample_3(std::vector<uint8_t>(large_sizes[i]))));
+        trace_cache::serialize(reservation.data(),
+                               test_sample_3(std::vector<uint8_t>(large_sizes[i], 5)));
+        reservation.commit();
+        EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(16, 6))));
+
+        // The threshold applies to each sample, not to the batch.
+        EXPECT_NO_THROW(
+            storage.store_batch(test_sample_3(std::vector<uint8_t>(3 * trace_cache::KByte, 7)),
+                                test_sample_3(std::vector<uint8_t>(3 * trace_cache::KByte, 8))));
+
+        g_mock_worker->execute_flush(true);
+        EXPECT_NO_THROW(storage.shutdown());
+
+        // Samples after an out-of-line one still go to the buffer.
+        EXPECT_EQ(storage.stats().dropped_samples, 0);
+        EXPECT_EQ(storage.stats().overflow_samples, 0);
+        EXPECT_EQ(storage.stats().out_of_line_samples, 2);
+        EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+                  (std::vector<uint8_t>{ 1, 2, 3, 4, 5, 6, 7, 8 }));
+    }
+}
+
+TEST_F(BufferedStorageOverrunTest, out_of_line_after_overflow)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, get_config(trace_cache::overrun_policy_t::grow));
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    // The fifth sample spills, the out-of-line one has to stay behind it.
+    storage.start();
+    for(uint8_t marker = 1; marker <= 5; ++marker)
+    {
+        EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+    }
+    EXPECT_NO_THROW(storage.store(
+        test_sample_3(std::vector<uint8_t>(trace_cache::buffer_size, 6))));
+    EXPECT_NO_THROW(storage.store(get_large_sample(7)));
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(storage.stats().dropped_samples, 0);
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 1, 2, 3, 4, 5, 6, 7 }));
+}
+
+TEST_F(BufferedStorageOverrunTest, out_of_line_keeps_segment_open)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size      = 64 * trace_cache::KByte;
+    config.segment_count    = 2;
+    config.overrun_policy   = trace_cache::overrun_policy_t::drop_newest;
+    config.out_of_line_size = 4 * trace_cache::KByte;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    // Small samples share a segment around the out-of-line ones.
+    storage.start();
+    std::vector<uint8_t> markers;
+    for(uint8_t marker = 1; marker <= 12; ++marker)
+    {
+        const size_t size = marker % 2 != 0 ? 16 : 8 * trace_cache::KByte;
+        EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(size, marker))));
+        markers.push_back(marker);
+    }
+    EXPECT_EQ(storage.stats().dropped_samples, 0);
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(storage.stats().out_of_line_samples, 6);
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()), markers);
+}
+
+TEST_F(BufferedStorageOverrunTest, out_of_line_queue_is_bounded)
+{
+    for(auto policy : { trace_cache::overrun_policy_t::drop_newest,
+                        trace_cache::overrun_policy_t::drop_oldest })
+    {
+        auto config             = get_config(policy);
+        config.buffer_size      = 64 * trace_cache::KByte;
+        config.out_of_line_size = 4 * trace_cache::KByte;
+
+        trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>
+            storage(test_file_path, config);
+        SetUpStartStopOnCall();
+        EXPECT_CALL(*g_mock_worker, start).Times(1);
+        EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+        // Only three records fit in the buffer size while nothing is flushed.
+        storage.start();
+        for(uint8_t marker = 1; marker <= 10; ++marker)
+        {
+            EXPECT_NO_THROW(storage.store(
+                test_sample_3(std::vector<uint8_t>(16 * trace_cache::KByte, marker))));
+        }
+        EXPECT_EQ(storage.stats().dropped_samples, 7);
+
+        g_mock_worker->execute_flush(true);
+        EXPECT_NO_THROW(storage.shutdown());
+
+        const auto expected = policy == trace_cache::overrun_policy_t::drop_newest
+                                  ? std::vector<uint8_t>{ 1, 2, 3 }
+                                  : std::vector<uint8_t>{ 8, 9, 10 };
+        EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+                  expected);
+    }
+}
+
+TEST_F(BufferedStorageTest, staging_buffer_published_in_batches)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.staging_buffer_size = 4 * trace_cache::KByte;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    std::vector<uint8_t> markers;
+    for(int i = 0; i < 10; ++i)
+    {
+        markers.push_back(static_cast<uint8_t>(i));
+        EXPECT_NO_THROW(
+            storage.store(test_sample_3(std::vector<uint8_t>(16, markers.back()))));
+    }
+
+    // Everything still fits in the staging buffer, nothing reached the ring.
+    g_mock_worker->execute_flush(true);
+    EXPECT_TRUE(g_mock_worker->m_output_string_stream.str().empty());
+
+    // Larger than the staging buffer, goes directly after the staged samples.
+    markers.push_back(0xAB);
+    EXPECT_NO_THROW(
+        storage.store(test_sample_3(std::vector<uint8_t>(8 * trace_cache::KByte, 0xAB))));
+
+    for(int i = 0; i < 1000; ++i)
+    {
+        markers.push_back(static_cast<uint8_t>(i));
+        EXPECT_NO_THROW(
+            storage.store(test_sample_3(std::vector<uint8_t>(16, markers.back()))));
+    }
+
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()), markers);
+}
+
+TEST_F(BufferedStorageTest, staging_buffer_published_on_thread_exit)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.staging_buffer_size = 64 * trace_cache::KByte;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const int                num_threads      = 4;
+    const int                items_per_thread = 10;
+    std::vector<std::thread> threads;
+
+    for(int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            for(int i = 0; i < items_per_thread; ++i)
+            {
+                EXPECT_NO_THROW(storage.store(
+                    test_sample_3(std::vector<uint8_t>(8, static_cast<uint8_t>(t)))));
+            }
+        });
+    }
+
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    g_mock_worker->execute_flush(true);
+    auto markers = get_sample_3_markers(g_mock_worker->m_output_string_stream.str());
+    EXPECT_EQ(markers.size(), num_threads * items_per_thread);
+    for(int t = 0; t < num_threads; ++t)
+    {
+        EXPECT_EQ(std::count(markers.begin(), markers.end(), t), items_per_thread);
+    }
+
+    EXPECT_NO_THROW(storage.shutdown());
+}
+
+TEST_F(BufferedStorageTest, runtime_buffer_size_and_threshold)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size     = 64 * trace_cache::KByte;
+    config.flush_threshold = 16 * trace_cache::KByte;
+    config.allocation      = trace_cache::buffer_allocation_t::mmap;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const size_t         payload_size = trace_cache::KByte;
+    std::vector<uint8_t> markers;
+    for(int i = 0; i < 200; ++i)
+    {
+        markers.push_back(static_cast<uint8_t>(i));
+        test_sample_3 sample(std::vector<uint8_t>(payload_size, markers.back()));
+        EXPECT_NO_THROW(storage.store(sample));
+
+        // The configured threshold decides when an unforced flush writes data.
+        g_mock_worker->execute_flush();
+    }
+
+    // Too large for the buffer, written after the samples stored before it.
+    markers.push_back(0x01);
+    test_sample_3 too_large(std::vector<uint8_t>(config.buffer_size, markers.back()));
+    EXPECT_NO_THROW(storage.store(too_large));
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()), markers);
+}
+
+TEST_F(BufferedStorageTest, invalid_config)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size = trace_cache::header_size<test_type_identifier_t>;
+    EXPECT_THROW(
+        (trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>(
+            test_file_path, config)),
+        std::runtime_error);
+
+    config.buffer_size         = 4 * trace_cache::KByte;
+    config.staging_buffer_size = 4 * trace_cache::KByte;
+    EXPECT_THROW(
+        (trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>(
+            test_file_path, config)),
+        std::runtime_error);
+
+    // A mapped output file keeps every sample in the ring, in file order.
+    config.staging_buffer_size = 0;
+    config.allocation          = trace_cache::buffer_allocation_t::mapped_file;
+    for(auto policy : { trace_cache::overrun_policy_t::drop_oldest,
+                        trace_cache::overrun_policy_t::grow })
+    {
+        config.overrun_policy = policy;
+        EXPECT_THROW(
+            (trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>(
+                test_file_path, config)),
+            std::runtime_error);
+    }
+
+    config.overrun_policy = trace_cache::overrun_policy_t::block;
+    config.file_format    = trace_cache::file_format_t::framed;
+    EXPECT_THROW(
+        (trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>(
+            test_file_path, config)),
+        std::runtime_error);
+
+    // The type index is written into framed files only.
+    config.allocation  = trace_cache::buffer_allocation_t::mmap;
+    config.file_format = trace_cache::file_format_t::raw;
+    config.type_index  = true;
+    EXPECT_THROW(
+        (trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>(
+            test_file_path, config)),
+        std::runtime_error);
+}
+
+TEST_F(BufferedStorageTest, buffer_allocation_modes)
+{
+    for(auto allocation :
+        { trace_cache::buffer_allocation_t::heap, trace_cache::buffer_allocation_t::mmap,
+          trace_cache::buffer_allocation_t::mmap_populate,
+          trace_cache::buffer_allocation_t::mmap_huge_pages })
+    {
+        trace_cache::buffered_storage_config_t config;
+        config.buffer_size = 3 * trace_cache::MByte + 1;
+        config.allocation  = allocation;
+
+        trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>
+            storage(test_file_path, config);
+        SetUpStartStopOnCall();
+        EXPECT_CALL(*g_mock_worker, start).Times(1);
+        EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+        storage.start();
+        for(uint8_t marker = 0; marker < 4; ++marker)
+        {
+            test_sample_3 sample(std::vector<uint8_t>(trace_cache::MByte, marker));
+            EXPECT_NO_THROW(storage.store(sample));
+            g_mock_worker->execute_flush(true);
+        }
+        EXPECT_NO_THROW(storage.shutdown());
+
+        EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+                  (std::vector<uint8_t>{ 0, 1, 2, 3 }));
+    }
+}
+
+TEST_F(BufferedStorageTest, crossing_threshold_requests_flush_once)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size     = 64 * trace_cache::KByte;
+    config.flush_threshold = 16 * trace_cache::KByte;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+    auto& sync = *g_mock_worker->m_sync;
+
+    test_sample_3 sample(std::vector<uint8_t>(trace_cache::KByte, 0x01));
+    for(int i = 0; i < 15; ++i)
+    {
+        storage.store(sample);
+    }
+    EXPECT_FALSE(sync.flush_requested);
+
+    storage.store(sample);
+    EXPECT_TRUE(sync.flush_requested);
+
+    // Further stores above the threshold do not signal again until a flush.
+    sync.flush_requested = false;
+    storage.store(sample);
+    EXPECT_FALSE(sync.flush_requested);
+
+    g_mock_worker->execute_flush();
+    EXPECT_FALSE(g_mock_worker->m_output_string_stream.str().empty());
+
+    for(int i = 0; i < 16; ++i)
+    {
+        storage.store(sample);
+    }
+    EXPECT_TRUE(sync.flush_requested);
+
+    EXPECT_NO_THROW(storage.shutdown());
+}
+
+TEST_F(BufferedStorageTest, store_batch)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    std::vector<test_sample_1> samples{ { 1, "first" }, { 2, "" }, { 3, "third" } };
+    test_sample_2              sample2(2.71828, 7);
+    test_sample_3              sample3({ 0x01, 0x02 });
+
+    EXPECT_NO_THROW(storage.store_batch(samples));
+    EXPECT_NO_THROW(storage.store_batch(samples.begin(), samples.begin() + 1));
+    EXPECT_NO_THROW(storage.store_batch(samples.end(), samples.end()));
+    EXPECT_NO_THROW(storage.store_batch(sample2, samples[2], sample3));
+
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+
+    std::string buffer_data = g_mock_worker->m_output_string_stream.str();
+    ASSERT_FALSE(buffer_data.empty());
+
+    const uint8_t* buffer     = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos = 0;
+
+    for(const auto& sample : samples)
+    {
+        verify_buffer_contains(sample, buffer, buffer_pos);
+    }
+    verify_buffer_contains(samples[0], buffer, buffer_pos);
+    verify_buffer_contains(sample2, buffer, buffer_pos);
+    verify_buffer_contains(samples[2], buffer, buffer_pos);
+    verify_buffer_contains(sample3, buffer, buffer_pos);
+
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+    EXPECT_THROW(storage.store_batch(samples), std::runtime_error);
+}
+
+TEST_F(BufferedStorageTest, concurrent_store_batch_is_contiguous)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.staging_buffer_size = trace_cache::KByte;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const int                num_threads        = 4;
+    const int                batches_per_thread = 50;
+    const size_t             batch_size         = 10;
+    std::vector<std::thread> threads;
+
+    for(int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&storage, t]() {
+            for(int i = 0; i < batches_per_thread; ++i)
+            {
+                std::vector<test_sample_3> batch(
+                    batch_size, test_sample_3(std::vector<uint8_t>(32, t)));
+                storage.store_batch(batch);
+            }
+        });
+    }
+
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+
+    auto markers = get_sample_3_markers(g_mock_worker->m_output_string_stream.str());
+    ASSERT_EQ(markers.size(), num_threads * batches_per_thread * batch_size);
+    for(size_t i = 0; i < markers.size(); i += batch_size)
+    {
+        EXPECT_TRUE(std::all_of(markers.begin() + i, markers.begin() + i + batch_size,
+                                [&](uint8_t marker) { return marker == markers[i]; }));
+    }
+}
+
+TEST_F(BufferedStorageTest, reserve_and_commit)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const int              value        = 42;
+    const std::string_view text         = "formatted in place";
+    const size_t           payload_size = trace_cache::utility::get_size(value, text);
+
+    auto reservation = storage.reserve<test_sample_1>(payload_size);
+    ASSERT_EQ(reservation.size(), payload_size);
+    trace_cache::utility::store_value(reservation.data(), value, text);
+    EXPECT_NO_THROW(reservation.commit());
+    EXPECT_THROW(reservation.commit(), std::runtime_error);
+
+    // Abandoned reservations become fragmented space.
+    {
+        auto abandoned = storage.reserve<test_sample_1>(payload_size);
+    }
+
+    test_sample_2 sample2(1.5, 3);
+    EXPECT_NO_THROW(storage.store(sample2));
+
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+    EXPECT_THROW(storage.reserve<test_sample_1>(payload_size), std::runtime_error);
+
+    std::string buffer_data = g_mock_worker->m_output_string_stream.str();
+    ASSERT_FALSE(buffer_data.empty());
+
+    const uint8_t* buffer     = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos = 0;
+
+    verify_buffer_contains(test_sample_1(value, text), buffer, buffer_pos);
+
+    auto type_id = *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+    EXPECT_EQ(type_id, test_type_identifier_t::fragmented_space);
+    buffer_pos += sizeof(test_type_identifier_t);
+    EXPECT_EQ(*reinterpret_cast<const size_t*>(buffer + buffer_pos), payload_size);
+    buffer_pos += sizeof(size_t) + payload_size;
+
+    verify_buffer_contains(sample2, buffer, buffer_pos);
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+}
+
+TEST_F(BufferedStorageTest, abandoned_reservation_is_not_end_of_stream)
+{
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    // The payload would read as the end-of-stream record once fragmented.
+    {
+        auto abandoned = storage.reserve<test_sample_3>(sizeof(uint64_t));
+        std::memcpy(abandoned.data(), &trace_cache::end_of_stream_magic,
+                    sizeof(uint64_t));
+    }
+    test_sample_2 sample2(1.5, 3);
+    EXPECT_NO_THROW(storage.store(sample2));
+
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = trace_cache::header_size<test_type_identifier_t>;
+
+    EXPECT_EQ(*reinterpret_cast<const test_type_identifier_t*>(buffer),
+              test_type_identifier_t::fragmented_space);
+    EXPECT_EQ(*reinterpret_cast<const uint64_t*>(buffer + buffer_pos), 0);
+    buffer_pos += sizeof(uint64_t);
+
+    verify_buffer_contains(sample2, buffer, buffer_pos);
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+}
+
+TEST_F(BufferedStorageOverrunTest, reserve_follows_overrun_policy)
+{
+    for(auto policy : { trace_cache::overrun_policy_t::drop_newest,
+                        trace_cache::overrun_policy_t::grow })
+    {
+        trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>
+            storage(test_file_path, get_config(policy));
+        SetUpStartStopOnCall();
+        EXPECT_CALL(*g_mock_worker, start).Times(1);
+        EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+        storage.start();
+        for(uint8_t marker = 1; marker <= 4; ++marker)
+        {
+            EXPECT_NO_THROW(storage.store(get_large_sample(marker)));
+        }
+
+        const auto sample = get_large_sample(5);
+        auto reservation  = storage.reserve<test_sample_3>(trace_cache::get_size(sample));
+        trace_cache::serialize(reservation.data(), sample);
+        reservation.commit();
+
+        const bool grow = policy == trace_cache::overrun_policy_t::grow;
+        EXPECT_EQ(storage.stats().dropped_samples, grow ? 0 : 1);
+        EXPECT_EQ(storage.stats().overflow_samples, grow ? 1 : 0);
+
+        EXPECT_NO_THROW(storage.shutdown());
+        g_mock_worker->execute_flush(true);
+
+        auto expected = std::vector<uint8_t>{ 1, 2, 3, 4 };
+        if(grow)
+        {
+            expected.push_back(5);
+        }
+        EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+                  expected);
+    }
+}
+
+TEST_F(BufferedStorageTest, end_of_stream_marker)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.end_of_stream_marker = true;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    test_sample_1 sample(7, "last sample");
+    EXPECT_NO_THROW(storage.store(sample));
+
+    // Only the final flush after shutdown closes the stream.
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+    g_mock_worker->execute_flush(true);
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = 0;
+
+    verify_buffer_contains(sample, buffer, buffer_pos);
+
+    auto type_id = *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+    EXPECT_EQ(type_id, test_type_identifier_t::fragmented_space);
+    buffer_pos += sizeof(test_type_identifier_t);
+    EXPECT_EQ(*reinterpret_cast<const size_t*>(buffer + buffer_pos), sizeof(uint64_t));
+    buffer_pos += sizeof(size_t);
+    EXPECT_EQ(*reinterpret_cast<const uint64_t*>(buffer + buffer_pos),
+              trace_cache::end_of_stream_magic);
+    buffer_pos += sizeof(uint64_t);
+
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+}
+
+TEST_F(BufferedStorageTest, interval_flush_during_shutdown_does_not_close)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.end_of_stream_marker = true;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+
+    const test_sample_1 first(1, "before shutdown");
+    const test_sample_1 second(2, "during shutdown");
+
+    // A forced flush on an elapsed interval races with shutdown, samples stored
+    // after it still come before the end marker.
+    EXPECT_CALL(*g_mock_worker, stop).Times(1).WillOnce([&] {
+        g_mock_worker->execute_flush(true);
+        storage.store(second);
+        g_mock_worker->m_sync->is_running = false;
+        g_mock_worker->m_sync->closing    = true;
+        g_mock_worker->execute_flush(true);
+    });
+
+    storage.start();
+    EXPECT_NO_THROW(storage.store(first));
+    EXPECT_NO_THROW(storage.shutdown());
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = 0;
+
+    verify_buffer_contains(first, buffer, buffer_pos);
+    verify_buffer_contains(second, buffer, buffer_pos);
+
+    auto type_id = *reinterpret_cast<const test_type_identifier_t*>(buffer + buffer_pos);
+    EXPECT_EQ(type_id, test_type_identifier_t::fragmented_space);
+    buffer_pos += trace_cache::header_size<test_type_identifier_t> + sizeof(uint64_t);
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+}
+
+TEST_F(BufferedStorageTest, framed_blocks)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.file_format    = trace_cache::file_format_t::framed;
+    config.block_checksum = true;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    std::vector<test_sample_1> samples = { test_sample_1(1, "first"),
+                                           test_sample_1(2, "second"),
+                                           test_sample_1(3, "third") };
+    storage.store(samples[0]);
+    storage.store(samples[1]);
+    g_mock_worker->execute_flush(true);
+    storage.store(samples[2]);
+    g_mock_worker->execute_flush(true);
+    // Nothing to write, no empty block.
+    g_mock_worker->execute_flush(true);
+    storage.shutdown();
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+    size_t         buffer_pos  = 0;
+
+    auto verify_block = [&](size_t first, size_t last) {
+        trace_cache::block_header_t header;
+        std::memcpy(&header, buffer + buffer_pos, sizeof(header));
+        buffer_pos += sizeof(header);
+
+        EXPECT_EQ(header.magic, trace_cache::block_magic);
+        EXPECT_EQ(header.flags, trace_cache::block_flag_checksum);
+        EXPECT_EQ(header.record_count, last - first + 1);
+        EXPECT_EQ(header.first_sequence, first);
+        EXPECT_EQ(header.last_sequence, last);
+        EXPECT_EQ(header.checksum,
+                  trace_cache::utility::crc32c(buffer + buffer_pos, header.length));
+
+        const size_t block_end = buffer_pos + header.length;
+        for(size_t i = first; i <= last; ++i)
+        {
+            verify_buffer_contains(samples[i], buffer, buffer_pos);
+        }
+        EXPECT_EQ(buffer_pos, block_end);
+    };
+
+    verify_block(0, 1);
+    verify_block(2, 2);
+    EXPECT_EQ(buffer_pos, buffer_data.size());
+}
+
+TEST_F(BufferedStorageTest, type_index_footer)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.file_format = trace_cache::file_format_t::framed;
+    config.type_index  = true;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    storage.store(test_sample_1(1, "first"));
+    storage.store(test_sample_1(2, "second"));
+    g_mock_worker->execute_flush(true);
+    const size_t second_block = g_mock_worker->m_output_string_stream.str().size();
+    storage.store(test_sample_3({ 0x01, 0x02 }));
+    storage.store(test_sample_1(3, "third"));
+    g_mock_worker->execute_flush(true);
+    const size_t index_block = g_mock_worker->m_output_string_stream.str().size();
+
+    // The index is written by the final flush only.
+    EXPECT_NO_THROW(storage.shutdown());
+    g_mock_worker->execute_flush(true);
+
+    std::string    buffer_data = g_mock_worker->m_output_string_stream.str();
+    const uint8_t* buffer      = reinterpret_cast<const uint8_t*>(buffer_data.data());
+
+    trace_cache::index_trailer_t trailer;
+    std::memcpy(&trailer, buffer + buffer_data.size() - sizeof(trailer), sizeof(trailer));
+    EXPECT_EQ(trailer.magic, trace_cache::index_magic);
+    EXPECT_EQ(trailer.index_offset, index_block);
+
+    trace_cache::block_header_t header;
+    std::memcpy(&header, buffer + index_block, sizeof(header));
+    EXPECT_EQ(header.flags, trace_cache::block_flag_index);
+    EXPECT_EQ(header.record_count, 0);
+    EXPECT_EQ(index_block + sizeof(header) + header.length, buffer_data.size());
+
+    size_t buffer_pos = index_block + sizeof(header);
+    auto   verify_entry =
+        [&](test_type_identifier_t type, size_t samples, std::vector<uint64_t> blocks) {
+            trace_cache::type_index_entry_t entry;
+            std::memcpy(&entry, buffer + buffer_pos, sizeof(entry));
+            buffer_pos += sizeof(entry);
+
+            EXPECT_EQ(entry.type, static_cast<uint64_t>(type));
+            EXPECT_EQ(entry.sample_count, samples);
+            ASSERT_EQ(entry.block_count, blocks.size());
+            for(const auto& block : blocks)
+            {
+                EXPECT_EQ(*reinterpret_cast<const uint64_t*>(buffer + buffer_pos), block);
+                buffer_pos += sizeof(uint64_t);
+            }
+        };
+
+    verify_entry(test_type_identifier_t::sample_type_1, 3, { 0, second_block });
+    verify_entry(test_type_identifier_t::sample_type_3, 1, { second_block });
+    EXPECT_EQ(buffer_pos + sizeof(trailer), buffer_data.size());
+}
+
+TEST_F(BufferedStorageOverrunTest, segmented_buffer_policies)
+{
+    // Two samples fit in a segment, the ninth finds every segment full.
+    auto sample = [](uint8_t marker) {
+        return test_sample_3(std::vector<uint8_t>(400, marker));
+    };
+
+    const std::vector<
+        std::pair<trace_cache::overrun_policy_t, std::vector<uint8_t>>>
+        cases{ { trace_cache::overrun_policy_t::drop_newest, { 1, 2, 3, 4, 5, 6, 7, 8 } },
+               { trace_cache::overrun_policy_t::drop_oldest, { 3, 4, 5, 6, 7, 8, 9 } },
+               { trace_cache::overrun_policy_t::grow, { 1, 2, 3, 4, 5, 6, 7, 8, 9 } },
+               { trace_cache::overrun_policy_t::block, { 1, 2, 3, 4, 5, 6, 7, 8, 9 } } };
+
+    for(const auto& [policy, expected] : cases)
+    {
+        auto config          = get_config(policy);
+        config.buffer_size   = 4 * trace_cache::KByte;
+        config.segment_count = 4;
+
+        trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t>
+            storage(test_file_path, config);
+        SetUpStartStopOnCall();
+        EXPECT_CALL(*g_mock_worker, start).Times(1);
+        EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+        storage.start();
+        for(uint8_t marker = 1; marker <= 8; ++marker)
+        {
+            EXPECT_NO_THROW(storage.store(sample(marker)));
+        }
+
+        if(policy != trace_cache::overrun_policy_t::block)
+        {
+            EXPECT_NO_THROW(storage.store(sample(9)));
+        }
+        else
+        {
+            std::atomic<bool> stored{ false };
+            std::thread       writer([&]() {
+                EXPECT_NO_THROW(storage.store(sample(9)));
+                stored = true;
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            EXPECT_FALSE(stored);
+            while(!stored)
+            {
+                g_mock_worker->execute_flush();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            writer.join();
+        }
+
+        g_mock_worker->execute_flush(true);
+        EXPECT_NO_THROW(storage.shutdown());
+
+        EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+                  expected);
+    }
+}
+
+TEST_F(BufferedStorageTest, segment_waits_for_pending_reservation)
+{
+    trace_cache::buffered_storage_config_t config;
+    config.buffer_size   = 4 * trace_cache::KByte;
+    config.segment_count = 2;
+
+    trace_cache::buffered_storage<mock_worker_factory_t, test_type_identifier_t> storage(
+        test_file_path, config);
+    SetUpStartStopOnCall();
+    EXPECT_CALL(*g_mock_worker, start).Times(1);
+    EXPECT_CALL(*g_mock_worker, stop).Times(1);
+
+    storage.start();
+
+    const test_sample_3 first(std::vector<uint8_t>(100, 1));
+    auto reservation = storage.reserve<test_sample_3>(trace_cache::get_size(first));
+    trace_cache::serialize(reservation.data(), first);
+    EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(100, 2))));
+
+    // The segment is sealed but not written before all of it is committed.
+    g_mock_worker->execute_flush(true);
+    EXPECT_TRUE(g_mock_worker->m_output_string_stream.str().empty());
+    EXPECT_NO_THROW(storage.store(test_sample_3(std::vector<uint8_t>(100, 3))));
+
+    reservation.commit();
+    g_mock_worker->execute_flush(true);
+    EXPECT_NO_THROW(storage.shutdown());
+
+    EXPECT_EQ(get_sample_3_markers(g_mock_worker->m_output_string_stream.str()),
+              (std::vector<uint8_t>{ 1, 2, 3 }));
+}
@@ -2,9 +2,11 @@
 
 #include <atomic>
 #include <chrono>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 class FlushWorkerTest : public ::testing::Test
 {
@@ -29,7 +31,7 @@ std::atomic<int> FlushWorkerTest::test_counter{ 0 };
 TEST_F(FlushWorkerTest, start_worker_in_correct_state)
 {
     bool worker_called   = false;
-    auto worker_function = [&](trace_cache::ofs_t&, bool) { worker_called = true; };
+    auto worker_function = [&](trace_cache::sink_t&, bool) { worker_called = true; };
 
     trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
     pid_t                       current_pid = getpid();
@@ -47,7 +49,7 @@ TEST_F(FlushWorkerTest, start_worker_in_correct_state)
 TEST_F(FlushWorkerTest, stop_worker_complete)
 {
     std::atomic<bool> worker_called{ false };
-    auto worker_function = [&](trace_cache::ofs_t&, bool) { worker_called = true; };
+    auto worker_function = [&](trace_cache::sink_t&, bool) { worker_called = true; };
 
     trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
     pid_t                       current_pid = getpid();
@@ -65,9 +67,11 @@ TEST_F(FlushWorkerTest, stop_worker_complete)
 TEST_F(FlushWorkerTest, worker_function_called_on_stop)
 {
     std::atomic<int>  call_count{ 0 };
+    std::atomic<int>  closing_calls{ 0 };
     std::atomic<bool> force_flag{ false };
-    auto              worker_function = [&](trace_cache::ofs_t&, bool force) {
+    auto              worker_function = [&](trace_cache::sink_t&, bool force) {
         call_count++;
+        closing_calls += worker_sync->closing ? 1 : 0;
         force_flag = force;
     };
 
@@ -76,15 +80,18 @@ TEST_F(FlushWorkerTest, worker_function_called_on_stop)
 
     worker.start(current_pid);
     std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(worker_sync->closing);
     worker.stop(current_pid);
 
     EXPECT_GE(call_count.load(), 1);
     EXPECT_TRUE(force_flag);
+    // Only the flush after the loop has exited is final.
+    EXPECT_EQ(closing_calls.load(), 1);
 }
 
 TEST_F(FlushWorkerTest, multiple_stop_calls_are_safe)
 {
-    auto worker_function = [](trace_cache::ofs_t&, bool) {};
+    auto worker_function = [](trace_cache::sink_t&, bool) {};
 
     trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
     pid_t                       current_pid = getpid();
@@ -102,7 +109,7 @@ TEST_F(FlushWorkerTest, multiple_stop_calls_are_safe)
 
 TEST_F(FlushWorkerTest, worker_factory_creates_valid_object)
 {
-    auto worker_function = [](trace_cache::ofs_t&, bool) {};
+    auto worker_function = [](trace_cache::sink_t&, bool) {};
 
     auto worker = trace_cache::flush_worker_factory_t::get_worker(
         worker_function, worker_sync, test_file_path);
@@ -113,7 +120,7 @@ TEST_F(FlushWorkerTest, worker_factory_creates_valid_object)
 
 TEST_F(FlushWorkerTest, worker_handles_invalid_path)
 {
-    auto        worker_function = [](trace_cache::ofs_t&, bool) {};
+    auto        worker_function = [](trace_cache::sink_t&, bool) {};
     std::string invalid_path    = "/invalid/path/file.bin";
 
     trace_cache::flush_worker_t worker(worker_function, worker_sync, invalid_path);
@@ -130,7 +137,7 @@ TEST_F(FlushWorkerTest, worker_handles_invalid_path)
 TEST_F(FlushWorkerTest, different_pid_start_stop)
 {
     std::atomic<bool> worker_called{ false };
-    auto worker_function = [&](trace_cache::ofs_t&, bool) { worker_called = true; };
+    auto worker_function = [&](trace_cache::sink_t&, bool) { worker_called = true; };
 
     trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
     pid_t                       parent_pid = getpid();
@@ -168,4 +175,124 @@ TEST_F(FlushWorkerTest, different_pid_start_stop)
         EXPECT_FALSE(worker_sync->is_running);
         EXPECT_TRUE(worker_called);
     }
-}
\ No newline at end of file
+}
+
+TEST_F(FlushWorkerTest, configured_flush_interval)
+{
+    std::atomic<int> call_count{ 0 };
+    auto worker_function = [&](trace_cache::sink_t&, bool) { call_count++; };
+
+    worker_sync->flush_interval = std::chrono::milliseconds(10000);
+    trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
+    pid_t                       current_pid = getpid();
+
+    worker.start(current_pid);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(call_count.load(), 1);
+
+    worker.stop(current_pid);
+    EXPECT_EQ(call_count.load(), 2);
+}
+
+TEST_F(FlushWorkerTest, request_flush_wakes_worker)
+{
+    std::atomic<int> call_count{ 0 };
+    auto worker_function = [&](trace_cache::sink_t&, bool) { call_count++; };
+
+    trace_cache::flush_worker_t worker(worker_function, worker_sync, test_file_path);
+    pid_t                       current_pid = getpid();
+
+    worker.start(current_pid);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(call_count.load(), 1);
+
+    worker_sync->request_flush();
+    for(int i = 0; i < 1000 && call_count.load() < 2; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(call_count.load(), 2);
+
+    worker.stop(current_pid);
+    EXPECT_EQ(call_count.load(), 3);
+}
+
+template <typename Sink>
+void
+verify_sink_output(const std::string& filepath)
+{
+    // Sizes around the O_DIRECT alignment and a range larger than its staging.
+    std::vector<uint8_t> expected;
+    {
+        Sink sink(filepath);
+        for(size_t size : { size_t{ 1 }, size_t{ 4095 }, size_t{ 4097 },
+                            size_t{ 9 * trace_cache::MByte }, size_t{ 100 } })
+        {
+            std::vector<uint8_t> first(size, static_cast<uint8_t>(size));
+            std::vector<uint8_t> second(size / 2 + 1, static_cast<uint8_t>(size + 1));
+            const iovec          ranges[] = { { first.data(), first.size() },
+                                              { second.data(), second.size() } };
+            sink.write(ranges, 2);
+            sink.flush();
+
+            expected.insert(expected.end(), first.begin(), first.end());
+            expected.insert(expected.end(), second.begin(), second.end());
+
+            std::ifstream ifs(filepath, std::ios::binary);
+            std::vector<uint8_t> written((std::istreambuf_iterator<char>(ifs)),
+                                         std::istreambuf_iterator<char>());
+            ASSERT_EQ(written, expected);
+        }
+    }
+
+    std::ifstream        ifs(filepath, std::ios::binary);
+    std::vector<uint8_t> written((std::istreambuf_iterator<char>(ifs)),
+                                 std::istreambuf_iterator<char>());
+    EXPECT_EQ(written, expected);
+}
+
+TEST_F(FlushWorkerTest, sinks_write_everything_in_order)
+{
+    verify_sink_output<trace_cache::file_sink_t>(test_file_path);
+    verify_sink_output<trace_cache::direct_file_sink_t>(test_file_path);
+    verify_sink_output<trace_cache::ofstream_sink_t>(test_file_path);
+}
+
+template <typename WorkerFactory>
+size_t
+written_by_worker(trace_cache::worker_synchronization_ptr_t worker_sync,
+                  const std::string&                        filepath)
+{
+    std::vector<uint8_t> data(5000, 0x5A);
+    auto worker_function = [&](trace_cache::sink_t& sink, bool force) {
+        if(force)
+        {
+            const iovec range{ data.data(), data.size() };
+            sink.write(&range, 1);
+        }
+    };
+
+    auto worker = WorkerFactory::get_worker(worker_function, worker_sync, filepath);
+    worker->start(getpid());
+    worker->stop(getpid());
+
+    std::ifstream ifs(filepath, std::ios::binary | std::ios::ate);
+    return static_cast<size_t>(ifs.tellg());
+}
+
+TEST_F(FlushWorkerTest, worker_factories_select_sink)
+{
+    EXPECT_EQ(written_by_worker<trace_cache::flush_worker_factory_t>(worker_sync,
+                                                                     test_file_path),
+              5000);
+
+    worker_sync = std::make_shared<trace_cache::worker_synchronization_t>();
+    EXPECT_EQ(written_by_worker<trace_cache::direct_flush_worker_factory_t>(
+                  worker_sync, test_file_path),
+              5000);
+
+    worker_sync = std::make_shared<trace_cache::worker_synchronization_t>();
+    EXPECT_EQ(written_by_worker<trace_cache::ofstream_flush_worker_factory_t>(
+                  worker_sync, test_file_path),
+              5000);
+}
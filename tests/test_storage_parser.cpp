@@ -1,6 +1,7 @@
 #include "mocked_types.hpp"
 #include "storage_parser.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cstddef>
 #include <filesystem>
@@ -8,6 +9,7 @@
 #include <gtest/gtest.h>
 #include <memory>
 #include <numeric>
+#include <sstream>
 #include <vector>
 
 class sample_processor_t
@@ -126,7 +128,7 @@ protected:
     void cleanup_test_file() { std::remove(test_file_path.c_str()); }
 
     template <typename T>
-    void write_vector(std::ofstream& ofs, const std::vector<T>& vec,
+    void write_vector(std::ostream& ofs, const std::vector<T>& vec,
                       test_type_identifier_t identifier)
     {
         for(const auto& sample : vec)
@@ -499,3 +501,361 @@ TEST_F(StorageParserTest, read_fragmented_space)
 
     EXPECT_NE(std::remove(test_file_path.c_str()), 0);
 }
+
+TEST_F(StorageParserTest, fragmented_space_keeps_stale_records)
+{
+    // The buffer is not cleared on wrap, so fragmented space may hold old
+    // records, which must not be read.
+    std::vector<test_sample_1> samples_1 = { test_sample_1(1, "kept") };
+    std::vector<test_sample_1> stale     = { test_sample_1(2, "stale"),
+                                             test_sample_1(3, "stale") };
+    std::vector<test_sample_2> samples_2 = { test_sample_2(2.71828, 777) };
+
+    for(auto read_mode :
+        { trace_cache::parser_read_mode_t::stream, trace_cache::parser_read_mode_t::mmap,
+          trace_cache::parser_read_mode_t::read_ahead })
+    {
+        {
+            std::ofstream ofs(test_file_path, std::ios::binary);
+            write_vector(ofs, samples_1, test_type_identifier_t::sample_type_1);
+
+            std::ostringstream stale_records;
+            write_vector(stale_records, stale, test_type_identifier_t::sample_type_1);
+            // Cut into the last stale record, as a wrap point would.
+            const std::string stale_bytes =
+                stale_records.str().substr(0, stale_records.str().size() - 3);
+
+            sample_header header;
+            header.type        = test_type_identifier_t::fragmented_space;
+            header.sample_size = stale_bytes.size();
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            ofs.write(stale_bytes.data(), stale_bytes.size());
+
+            write_vector(ofs, samples_2, test_type_identifier_t::sample_type_2);
+        }
+
+        auto processor = std::make_unique<sample_processor_t>();
+        processor->set_expected_samples_1(samples_1);
+        processor->set_expected_samples_2(samples_2);
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser_config_t config;
+        config.read_mode = read_mode;
+
+        trace_cache::storage_parser<test_type_identifier_t, sample_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), config);
+
+        EXPECT_NO_THROW(parser.load());
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), 1);
+        EXPECT_EQ(processor_ptr->get_sample_2_count(), 1);
+        EXPECT_EQ(processor_ptr->get_unknown_count(), 0);
+    }
+}
+
+TEST_F(StorageParserTest, load_with_every_read_mode)
+{
+    std::vector<test_sample_1> samples_1 = { test_sample_1(1, "first"),
+                                             test_sample_1(2, "second") };
+    std::vector<test_sample_2> samples_2 = { test_sample_2(3.14159, 555) };
+    std::vector<test_sample_3> samples_3 = { test_sample_3({ 0x01, 0x02, 0x03 }),
+                                             test_sample_3() };
+
+    for(auto read_mode :
+        { trace_cache::parser_read_mode_t::stream, trace_cache::parser_read_mode_t::mmap,
+          trace_cache::parser_read_mode_t::mmap_populate,
+          trace_cache::parser_read_mode_t::read_ahead })
+    {
+        create_test_file_with_samples(samples_1, samples_2, samples_3);
+        {
+            // Truncated record at the end of the file is skipped.
+            std::ofstream ofs(test_file_path, std::ios::binary | std::ios::app);
+            sample_header header;
+            header.type        = test_type_identifier_t::sample_type_1;
+            header.sample_size = 100;
+            ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        auto processor = std::make_unique<sample_processor_t>();
+        processor->set_expected_samples_1(samples_1);
+        processor->set_expected_samples_2(samples_2);
+        processor->set_expected_samples_3(samples_3);
+        auto processor_ptr = processor.get();
+
+        // Records are split across the read-ahead buffers.
+        trace_cache::storage_parser_config_t config;
+        config.read_mode          = read_mode;
+        config.read_ahead_size    = 16;
+        config.read_ahead_buffers = 2;
+
+        trace_cache::storage_parser<test_type_identifier_t, sample_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), config);
+
+        EXPECT_NO_THROW(parser.load());
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), 2);
+        EXPECT_EQ(processor_ptr->get_sample_2_count(), 1);
+        EXPECT_EQ(processor_ptr->get_sample_3_count(), 2);
+        EXPECT_FALSE(std::filesystem::exists(test_file_path));
+    }
+}
+
+TEST_F(StorageParserTest, parallel_load)
+{
+    std::vector<test_sample_1> samples_1;
+    std::vector<test_sample_2> samples_2;
+    std::vector<test_sample_3> samples_3;
+    for(int i = 0; i < 5000; ++i)
+    {
+        samples_1.emplace_back(i, "parallel");
+        samples_2.emplace_back(i * 0.5, i);
+        samples_3.emplace_back(std::vector<uint8_t>(i % 64, static_cast<uint8_t>(i)));
+    }
+
+    for(auto delivery : { trace_cache::parser_delivery_t::ordered,
+                          trace_cache::parser_delivery_t::unordered })
+    {
+        create_test_file_with_samples(samples_1, samples_2, samples_3);
+
+        auto processor = std::make_unique<sample_processor_t>();
+        if(delivery == trace_cache::parser_delivery_t::ordered)
+        {
+            processor->set_expected_samples_1(samples_1);
+            processor->set_expected_samples_2(samples_2);
+            processor->set_expected_samples_3(samples_3);
+        }
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser_config_t config;
+        config.threads    = 4;
+        config.chunk_size = 4 * trace_cache::KByte;
+        config.delivery   = delivery;
+
+        trace_cache::storage_parser<test_type_identifier_t, sample_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>
+            parser(test_file_path, std::move(processor), config);
+
+        EXPECT_NO_THROW(parser.load());
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), samples_1.size());
+        EXPECT_EQ(processor_ptr->get_sample_2_count(), samples_2.size());
+        EXPECT_EQ(processor_ptr->get_sample_3_count(), samples_3.size());
+        EXPECT_FALSE(std::filesystem::exists(test_file_path));
+    }
+}
+
+// Receives samples as their concrete types, without execute_sample_processing.
+// Views into the parsed file are only valid during process(), so text is copied.
+class typed_sample_processor_t
+{
+public:
+    void process(const test_sample_1& sample)
+    {
+        samples_1.emplace_back(sample.value, std::string{ sample.text });
+    }
+
+    void process(const test_sample_2& sample) { samples_2.push_back(sample); }
+
+    std::vector<std::pair<int, std::string>> samples_1;
+    std::vector<test_sample_2>               samples_2;
+};
+
+TEST_F(StorageParserTest, load_with_typed_processing)
+{
+    static_assert(trace_cache::type_traits::has_any_typed_processing_v<
+                  typed_sample_processor_t, test_sample_1, test_sample_3>);
+    static_assert(!trace_cache::type_traits::has_any_typed_processing_v<
+                  typed_sample_processor_t, test_sample_3>);
+
+    std::vector<test_sample_1> samples_1;
+    std::vector<test_sample_2> samples_2;
+    for(int i = 0; i < 1000; ++i)
+    {
+        samples_1.emplace_back(i, "typed");
+        samples_2.emplace_back(i * 0.25, i);
+    }
+
+    for(size_t threads : { 1, 4 })
+    {
+        create_test_file_with_samples(samples_1, samples_2, {});
+
+        auto processor     = std::make_unique<typed_sample_processor_t>();
+        auto processor_ptr = processor.get();
+
+        trace_cache::storage_parser_config_t config;
+        config.threads    = threads;
+        config.chunk_size = trace_cache::KByte;
+
+        trace_cache::storage_parser<test_type_identifier_t, typed_sample_processor_t,
+                                    test_sample_1, test_sample_2>
+            parser(test_file_path, std::move(processor), config);
+
+        EXPECT_NO_THROW(parser.load());
+
+        ASSERT_EQ(processor_ptr->samples_1.size(), samples_1.size());
+        for(size_t i = 0; i < samples_1.size(); ++i)
+        {
+            EXPECT_EQ(processor_ptr->samples_1[i].first, samples_1[i].value);
+            EXPECT_EQ(processor_ptr->samples_1[i].second, samples_1[i].text);
+        }
+        EXPECT_EQ(processor_ptr->samples_2, samples_2);
+    }
+}
+
+TEST_F(StorageParserTest, decoder_consumes_split_records)
+{
+    std::vector<test_sample_1> samples_1 = { test_sample_1(1, "split"),
+                                             test_sample_1(2, "records") };
+    std::vector<test_sample_3> samples_3 = { test_sample_3({ 0x0A, 0x0B }) };
+    create_test_file_with_samples(samples_1, {}, samples_3);
+
+    std::vector<uint8_t> data;
+    {
+        std::ifstream ifs(test_file_path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(ifs),
+                    std::istreambuf_iterator<char>());
+    }
+
+    sample_header end_header;
+    end_header.type        = test_type_identifier_t::fragmented_space;
+    end_header.sample_size = sizeof(uint64_t);
+    const auto* end_bytes  = reinterpret_cast<const uint8_t*>(&end_header);
+    data.insert(data.end(), end_bytes, end_bytes + sizeof(end_header));
+    const auto* magic_bytes =
+        reinterpret_cast<const uint8_t*>(&trace_cache::end_of_stream_magic);
+    data.insert(data.end(), magic_bytes, magic_bytes + sizeof(uint64_t));
+    data.push_back(0xFF);
+
+    sample_processor_t processor;
+    processor.set_expected_samples_1(samples_1);
+    processor.set_expected_samples_3(samples_3);
+
+    trace_cache::sample_decoder<test_type_identifier_t, sample_processor_t, test_sample_1,
+                                test_sample_2, test_sample_3>
+        decoder(processor);
+
+    // Feed one byte at a time, every record is split across calls.
+    for(size_t i = 0; i + 1 < data.size(); ++i)
+    {
+        EXPECT_TRUE(decoder.consume(data.data() + i, 1) || i + 2 == data.size());
+    }
+    EXPECT_TRUE(decoder.end_of_stream());
+    EXPECT_FALSE(decoder.consume(data.data() + data.size() - 1, 1));
+
+    EXPECT_EQ(processor.get_sample_1_count(), 2);
+    EXPECT_EQ(processor.get_sample_3_count(), 1);
+    EXPECT_EQ(decoder.pending_bytes(), 0);
+
+    // Split inside the first record, only that record is kept aside.
+    sample_processor_t split_processor;
+    split_processor.set_expected_samples_1(samples_1);
+    split_processor.set_expected_samples_3(samples_3);
+    trace_cache::sample_decoder<test_type_identifier_t, sample_processor_t, test_sample_1,
+                                test_sample_2, test_sample_3>
+        split_decoder(split_processor);
+
+    const size_t split = sizeof(sample_header) + 2;
+    EXPECT_TRUE(split_decoder.consume(data.data(), split));
+    EXPECT_EQ(split_decoder.pending_bytes(), split);
+    EXPECT_FALSE(split_decoder.consume(data.data() + split, data.size() - split));
+    EXPECT_EQ(split_processor.get_sample_1_count(), 2);
+    EXPECT_EQ(split_processor.get_sample_3_count(), 1);
+    EXPECT_EQ(split_decoder.pending_bytes(), 0);
+
+    // Fragmented space split across chunks is skipped, not kept aside.
+    sample_header fragment_header;
+    fragment_header.type        = test_type_identifier_t::fragmented_space;
+    fragment_header.sample_size = 1024 * 1024;
+    const auto* fragment_bytes  = reinterpret_cast<const uint8_t*>(&fragment_header);
+    std::vector<uint8_t> fragmented(fragment_bytes,
+                                    fragment_bytes + sizeof(fragment_header));
+    fragmented.resize(fragmented.size() + fragment_header.sample_size, 0xAA);
+    fragmented.insert(fragmented.end(), data.begin(), data.end());
+
+    sample_processor_t fragment_processor;
+    fragment_processor.set_expected_samples_1(samples_1);
+    fragment_processor.set_expected_samples_3(samples_3);
+    trace_cache::sample_decoder<test_type_identifier_t, sample_processor_t, test_sample_1,
+                                test_sample_2, test_sample_3>
+        fragment_decoder(fragment_processor);
+
+    const size_t chunk_size  = 64 * 1024 + 3;
+    size_t       max_pending = 0;
+    for(size_t i = 0; i < fragmented.size(); i += chunk_size)
+    {
+        fragment_decoder.consume(fragmented.data() + i,
+                                 std::min(chunk_size, fragmented.size() - i));
+        max_pending = std::max(max_pending, fragment_decoder.pending_bytes());
+        EXPECT_EQ(fragment_decoder.incomplete(), !fragment_decoder.end_of_stream());
+    }
+    EXPECT_TRUE(fragment_decoder.end_of_stream());
+    EXPECT_LT(max_pending, data.size());
+    EXPECT_EQ(fragment_processor.get_sample_1_count(), 2);
+    EXPECT_EQ(fragment_processor.get_sample_3_count(), 1);
+}
+
+// Handles test_sample_3 only, the other types are never deserialized.
+class sample_3_processor_t
+{
+public:
+    void process(const test_sample_3& sample) { samples_3.push_back(sample); }
+
+    std::vector<test_sample_3> samples_3;
+};
+
+TEST_F(StorageParserTest, skip_unwanted_types)
+{
+    std::vector<test_sample_1> samples_1;
+    std::vector<test_sample_2> samples_2;
+    std::vector<test_sample_3> samples_3;
+    for(int i = 0; i < 300; ++i)
+    {
+        samples_1.emplace_back(i, "skipped");
+        samples_2.emplace_back(i * 0.5, i);
+        samples_3.emplace_back(std::vector<uint8_t>{ static_cast<uint8_t>(i) });
+    }
+
+    using parser_t =
+        trace_cache::storage_parser<test_type_identifier_t, sample_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>;
+    using typed_parser_t =
+        trace_cache::storage_parser<test_type_identifier_t, sample_3_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>;
+    using typed_decoder_t =
+        trace_cache::sample_decoder<test_type_identifier_t, sample_3_processor_t,
+                                    test_sample_1, test_sample_2, test_sample_3>;
+    EXPECT_EQ(typed_decoder_t::handled_types(), typed_decoder_t::type_mask_t{ 0b100 });
+
+    for(auto read_mode : { trace_cache::parser_read_mode_t::stream,
+                           trace_cache::parser_read_mode_t::mmap })
+    {
+        trace_cache::storage_parser_config_t config;
+        config.read_mode = read_mode;
+
+        // Runtime mask selecting test_sample_2.
+        create_test_file_with_samples(samples_1, samples_2, samples_3);
+        auto processor     = std::make_unique<sample_processor_t>();
+        auto processor_ptr = processor.get();
+        processor->set_expected_samples_2(samples_2);
+
+        parser_t parser(test_file_path, std::move(processor), config);
+        parser.set_type_mask(parser_t::type_mask_t{ 0b010 });
+        EXPECT_NO_THROW(parser.load());
+
+        EXPECT_EQ(processor_ptr->get_sample_1_count(), 0);
+        EXPECT_EQ(processor_ptr->get_sample_2_count(), samples_2.size());
+        EXPECT_EQ(processor_ptr->get_sample_3_count(), 0);
+
+        // Mask derived from the process(const T&) overloads.
+        create_test_file_with_samples(samples_1, samples_2, samples_3);
+        auto typed_processor     = std::make_unique<sample_3_processor_t>();
+        auto typed_processor_ptr = typed_processor.get();
+
+        typed_parser_t typed_parser(test_file_path, std::move(typed_processor), config);
+        EXPECT_NO_THROW(typed_parser.load());
+
+        EXPECT_EQ(typed_processor_ptr->samples_3, samples_3);
+    }
+}
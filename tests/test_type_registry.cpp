@@ -100,4 +100,52 @@ TEST_F(TypeRegistryTest, test_multiple_calls_same_type)
     EXPECT_EQ(sample_1_1.text, "first");
     EXPECT_EQ(sample_1_2.value, 200);
     EXPECT_EQ(sample_1_2.text, "second");
-}
\ No newline at end of file
+}
+
+TEST_F(TypeRegistryTest, test_dispatch_concrete_type)
+{
+    test_sample_2        test_value{ 2.5, 7 };
+    std::vector<uint8_t> buffer(trace_cache::get_size(test_value));
+    trace_cache::serialize(buffer.data(), test_value);
+
+    auto buffer_data = buffer.data();
+    int  calls       = 0;
+    bool found       = type_registry.dispatch(
+        test_type_identifier_t::sample_type_2, buffer_data, [&](auto&& sample) {
+            using type_t = std::decay_t<decltype(sample)>;
+            EXPECT_TRUE((std::is_same_v<type_t, test_sample_2>) );
+            if constexpr(std::is_same_v<type_t, test_sample_2>)
+            {
+                EXPECT_EQ(sample, test_value);
+            }
+            calls++;
+        });
+
+    EXPECT_TRUE(found);
+    EXPECT_EQ(calls, 1);
+
+    found = type_registry.dispatch(test_type_identifier_t::sample_type_3, buffer_data,
+                                   [&](auto&&) { calls++; });
+    EXPECT_FALSE(found);
+    EXPECT_EQ(calls, 1);
+}
+
+TEST_F(TypeRegistryTest, test_unique_identifiers)
+{
+    using trace_cache::type_traits::has_unique_identifiers;
+
+    EXPECT_TRUE((has_unique_identifiers<test_type_identifier_t, test_sample_1,
+                                        test_sample_2, test_sample_3>()));
+    EXPECT_FALSE((has_unique_identifiers<test_type_identifier_t, test_sample_1,
+                                         test_sample_2, test_sample_1>()));
+}
+
+TEST_F(TypeRegistryTest, test_index_of)
+{
+    using registry_t = decltype(type_registry);
+
+    static_assert(registry_t::index_of(test_type_identifier_t::sample_type_1) == 0);
+    EXPECT_EQ(registry_t::index_of(test_type_identifier_t::sample_type_2), 1);
+    EXPECT_EQ(registry_t::index_of(test_type_identifier_t::sample_type_3), 2);
+    EXPECT_EQ(registry_t::index_of(test_type_identifier_t::fragmented_space), 2);
+}